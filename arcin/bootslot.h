@@ -0,0 +1,227 @@
+#ifndef BOOTSLOT_DEFINES_H
+#define BOOTSLOT_DEFINES_H
+
+#include <stdint.h>
+#include "crc32.h"
+
+// Firmware slots, shared by the bootloader and the firmware
+//
+// The firmware is built for each slot (arcin.ld, arcin_b.ld). The bootloader
+// flashes the slot it isn't booting, and boots the newest slot whose image
+// verifies. A new image boots on trial: the bootloader marks it tried and
+// starts the watchdog, and the firmware marks it confirmed once it has run
+// for SLOT_CONFIRM_MS. A slot that was tried SLOT_TRIAL_ATTEMPTS times but
+// never confirmed is skipped from then on, which rolls back to the other
+// slot.
+//
+// Only images that carry the slot marker (see image_confirms_slot()) boot on
+// trial. Older firmware would never confirm its slot nor feed the watchdog,
+// so it boots as it is, without a rollback.
+//
+// Only the bootloader writes the slots. The running firmware doesn't update
+// the other one in the background: the flash has a single bank, so every
+// program and erase would stall its input sampling and USB (20-40 ms per
+// page erase).
+//
+// Flash layout (256k):
+//   0x8000000  bootloader
+//   0x8002000  slot A
+//   0x801f000  config pages A, B (see Configloader)
+//   0x8020000  slot B
+//   0x803f000  slot B info
+//   0x803f800  slot A info (where older bootloaders kept their image info)
+
+#define SLOT_COUNT 2
+
+struct boot_slot_t {
+    uint32_t start;
+    uint32_t end;
+    uint32_t info;
+};
+
+static const boot_slot_t boot_slots[SLOT_COUNT] = {
+    {0x8002000, 0x801f000, 0x803f800},
+    {0x8020000, 0x803d000, 0x803f000},
+};
+
+// Trial boots an image gets to confirm its slot. A trial cut short by a power
+// loss can't be told from one the watchdog ended, so one failed trial isn't
+// enough to give up on the image.
+#define SLOT_TRIAL_ATTEMPTS 3
+
+// Each field starts out erased and is programmed once. Flash only takes
+// halfwords that are erased, so the flags are separate halfwords. The first
+// four fields are the image info of older bootloaders, which left the rest
+// erased.
+struct slot_info_t {
+    // SLOT_STARTED once flashing began
+    uint32_t started;
+
+    uint32_t length;
+    uint32_t crc;
+
+    // SLOT_COMPLETE once the others are written
+    uint32_t complete;
+
+    // higher is newer; erased if written by an older bootloader
+    uint32_t sequence;
+
+    // 0 once booted unconfirmed
+    uint16_t tried;
+
+    // 0 once the firmware ran long enough
+    uint16_t confirmed;
+
+    // 0 if the image carries the slot marker
+    uint16_t confirms;
+
+    // 0 for each further unconfirmed boot, in order
+    uint16_t retried[SLOT_TRIAL_ATTEMPTS - 1];
+};
+
+#define SLOT_STARTED  0xb007da7a
+#define SLOT_COMPLETE 0xc0de600d
+
+#define SLOT_FLAG_SET 0
+
+// Healthy running time before the firmware confirms its slot
+#define SLOT_CONFIRM_MS 5000
+
+// Firmware that confirms its slot carries these two words, in this order,
+// word aligned anywhere in its image
+#define SLOT_MARKER_0 0x746f6c73
+#define SLOT_MARKER_1 0xc0f1e3ed
+
+static inline const slot_info_t* slot_info(uint32_t slot) {
+    return (const slot_info_t*)boot_slots[slot].info;
+}
+
+// The flag the next trial boot programs, or null once the image has had all
+// its trials
+static inline const uint16_t* slot_next_trial(const slot_info_t* info) {
+    if (info->tried != SLOT_FLAG_SET) {
+        return &info->tried;
+    }
+
+    for (uint32_t n = 0; n < SLOT_TRIAL_ATTEMPTS - 1; n++) {
+        if (info->retried[n] != SLOT_FLAG_SET) {
+            return &info->retried[n];
+        }
+    }
+
+    return nullptr;
+}
+
+enum slot_check_t {
+    SLOT_OK,
+    SLOT_EMPTY,
+    SLOT_INCOMPLETE,
+    SLOT_BAD_CRC,
+    SLOT_FAILED,
+};
+
+// Whether the slot holds a bootable image, and its sequence number (0 if
+// not, or if its bootloader didn't write one). crc32_init() must have been
+// called.
+static inline slot_check_t check_slot(uint32_t slot, uint32_t* sequence) {
+    const boot_slot_t& bounds = boot_slots[slot];
+    const slot_info_t* info = slot_info(slot);
+    const uint32_t* vtors = (const uint32_t*)bounds.start;
+
+    *sequence = 0;
+
+    // Check that reset vector is a valid flash address in this slot.
+    if (vtors[1] < bounds.start || vtors[1] >= bounds.end) {
+        return SLOT_EMPTY;
+    }
+
+    // Slot A flashed by a bootloader older than image info
+    if (info->started == 0xffffffff) {
+        return slot == 0 ? SLOT_OK : SLOT_EMPTY;
+    }
+
+    if (info->started != SLOT_STARTED || info->complete != SLOT_COMPLETE) {
+        return SLOT_INCOMPLETE;
+    }
+
+    if (info->length < 8 || info->length > bounds.end - bounds.start) {
+        return SLOT_INCOMPLETE;
+    }
+
+    if (crc32(vtors, info->length) != info->crc) {
+        return SLOT_BAD_CRC;
+    }
+
+    // Out of trial boots and never confirmed
+    if (info->confirmed != SLOT_FLAG_SET && !slot_next_trial(info)) {
+        return SLOT_FAILED;
+    }
+
+    *sequence = info->sequence == 0xffffffff ? 0 : info->sequence;
+    return SLOT_OK;
+}
+
+// Whether the image carries the slot marker
+static inline bool image_confirms_slot(uint32_t start, uint32_t length) {
+    const uint32_t* words = (const uint32_t*)start;
+
+    for (uint32_t n = 0; n + 1 < length / 4; n++) {
+        if (words[n] == SLOT_MARKER_0 && words[n + 1] == SLOT_MARKER_1) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// The newest slot that checks out, or -1
+static inline int select_slot() {
+    int best = -1;
+    uint32_t best_sequence = 0;
+
+    for (uint32_t slot = 0; slot < SLOT_COUNT; slot++) {
+        uint32_t sequence;
+
+        if (check_slot(slot, &sequence) != SLOT_OK) {
+            continue;
+        }
+
+        if (best < 0 || sequence > best_sequence) {
+            best = slot;
+            best_sequence = sequence;
+        }
+    }
+
+    return best;
+}
+
+// Independent watchdog, started by the bootloader for trial boots. Only a
+// reset stops it, so the firmware refreshes it every main loop iteration
+// (which does nothing if it isn't running).
+struct IWDG_reg_t {
+    volatile uint32_t KR;
+    volatile uint32_t PR;
+    volatile uint32_t RLR;
+    volatile uint32_t SR;
+};
+
+static IWDG_reg_t& IWDG_unit = *(IWDG_reg_t*)0x40003000;
+
+// ~40 kHz LSI / 256, so about 8 s
+#define IWDG_PRESCALER 6
+#define IWDG_RELOAD    1250
+
+static inline void iwdg_start() {
+    IWDG_unit.KR = 0xcccc; // start
+    IWDG_unit.KR = 0x5555; // unlock PR, RLR
+    IWDG_unit.PR = IWDG_PRESCALER;
+    IWDG_unit.RLR = IWDG_RELOAD;
+    while (IWDG_unit.SR);
+    IWDG_unit.KR = 0xaaaa;
+}
+
+static inline void iwdg_refresh() {
+    IWDG_unit.KR = 0xaaaa;
+}
+
+#endif
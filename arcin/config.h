@@ -2,6 +2,7 @@
 #define CONFIG_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include "inttypes.h"
 #include "color.h"
 
@@ -31,7 +32,17 @@ typedef union _config_flags {
         uint32_t TtLedReactive: 1;
         uint32_t TtLedHid: 1;
         uint32_t Ws2812b: 1;
-        uint32_t Reserved: 18;
+
+        // Apply tt_accel_curve to the analog turntable
+        uint32_t TtAccelEnable: 1;
+
+        // Use the N-key rollover bitmap report instead of the 13-key array
+        uint32_t KeyboardNkro: 1;
+
+        // Expose gamepad and keyboard on a single HID interface, using
+        // combined_report_desc. Telemetry is not available in this mode.
+        uint32_t SingleInterface: 1;
+        uint32_t Reserved: 15;
     };
 
     uint32_t AsUINT32;
@@ -97,10 +108,33 @@ struct config_t {
 
     rgb_config rgb;
 
-    uint8_t reserved2[3];
+    // Analog turntable acceleration - gain at each control point in
+    // tt_accel_points (3.5 fixed point, 32 = 1.0x, 0 = 1.0x)
+    uint8_t tt_accel_curve[3];
 };
 
-// From config_report_t.data[60]
-static_assert(sizeof(config_t) == 60, "config size mismatch");
+// The first segment is the layout understood by older firmware and tools
+// (config_report_t.data[60]). Anything added to config_t goes after it, and is
+// only reachable through segmented transfers (see config_transfer.h).
+#define CONFIG_SEGMENT_SIZE 60
+#define CONFIG_MAX_SEGMENTS 8
+#define CONFIG_MAX_SIZE     (CONFIG_SEGMENT_SIZE * CONFIG_MAX_SEGMENTS)
+
+static_assert(
+    offsetof(config_t, tt_accel_curve) + sizeof(config_t::tt_accel_curve) ==
+    CONFIG_SEGMENT_SIZE,
+    "legacy config layout mismatch");
+
+static_assert(sizeof(config_t) <= CONFIG_MAX_SIZE, "config too large");
+
+#define CONFIG_PROFILE_COUNT 4
+
+// Everything kept in flash. profiles[0] comes first, so a stored single
+// config_t reads back as profile 0 and vice versa.
+struct config_store_t {
+    config_t profiles[CONFIG_PROFILE_COUNT];
+    uint8_t active_profile;
+    uint8_t reserved[3];
+};
 
 #endif
@@ -0,0 +1,221 @@
+#ifndef CONFIG_SCHEMA_H
+#define CONFIG_SCHEMA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "config.h"
+
+// Flash encoding of config_store_t
+//
+// Stored configs are tag-length-value encoded, so fields can be added (or
+// dropped) without depending on where they sit in config_t:
+//
+//   legacy prefix   CONFIG_SEGMENT_SIZE bytes, the active profile in the
+//                   legacy config_t layout, for older firmware
+//   header          magic, schema version
+//   entries         tag, length, value; until the end of the data or an
+//                   erased (0xff) tag
+//
+// Each profile starts with a CONFIG_TAG_PROFILE entry, followed by the
+// entries of its fields. Fields that are all zero are left out and decode as
+// zero.
+//
+// Decoding skips unknown tags, so configs saved by newer firmware load with
+// the fields this firmware knows about. Values shorter than the field are
+// zero-extended and longer ones are truncated, so a field can grow at the
+// end. Data without the header is the legacy layout: a config_store_t, or a
+// single config_t saved by firmware from before profiles, which every
+// profile starts out as.
+//
+// Tags are never reused. Retire a tag by removing it from CONFIG_FIELDS.
+
+#define CONFIG_SCHEMA_MAGIC   0xc0f17a9e
+
+// Bump when the meaning of an existing tag changes, and migrate older
+// versions in config_decode()
+#define CONFIG_SCHEMA_VERSION 1
+
+// Store-level tags
+#define CONFIG_TAG_PROFILE        0x80
+#define CONFIG_TAG_ACTIVE_PROFILE 0x81
+
+// Tags 0x00 and 0xff end the entries (0xff being erased flash)
+#define CONFIG_TAG_END    0x00
+#define CONFIG_TAG_ERASED 0xff
+
+// Field registry: tag, config_t member
+#define CONFIG_FIELDS(X) \
+    X(0x01, label) \
+    X(0x02, flags) \
+    X(0x03, qe1_sens) \
+    X(0x04, qe2_sens) \
+    X(0x05, debounce_ticks) \
+    X(0x06, keycodes) \
+    X(0x07, remap_start_sel) \
+    X(0x08, remap_b8_b9) \
+    X(0x09, rgb) \
+    X(0x0a, tt_accel_curve) \
+    X(0x0b, reserved0) \
+    X(0x0c, reserved1)
+
+struct config_field_t {
+    uint8_t tag;
+    uint8_t offset;
+    uint8_t size;
+};
+
+#define CONFIG_FIELD_ENTRY(tag, member) \
+    {tag, offsetof(config_t, member), sizeof(config_t::member)},
+
+static const config_field_t config_fields[] = {
+    CONFIG_FIELDS(CONFIG_FIELD_ENTRY)
+};
+
+#undef CONFIG_FIELD_ENTRY
+
+#define CONFIG_FIELD_COUNT (sizeof(config_fields) / sizeof(config_fields[0]))
+
+struct config_schema_header_t {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t reserved[3];
+};
+
+// tag, length
+#define CONFIG_TLV_OVERHEAD 2
+
+// Largest encoding: every field of every profile present
+#define CONFIG_FIELD_SIZE(tag, member) \
+    + (CONFIG_TLV_OVERHEAD + sizeof(config_t::member))
+
+#define CONFIG_ENCODED_PROFILE_MAX \
+    ((CONFIG_TLV_OVERHEAD + 1) CONFIG_FIELDS(CONFIG_FIELD_SIZE))
+
+#define CONFIG_ENCODED_MAX \
+    (CONFIG_SEGMENT_SIZE + sizeof(config_schema_header_t) + \
+     (CONFIG_TLV_OVERHEAD + 1) + \
+     CONFIG_PROFILE_COUNT * CONFIG_ENCODED_PROFILE_MAX)
+
+static_assert(sizeof(config_t) <= 0xff, "field offsets must fit in a byte");
+
+static bool config_is_zero(const uint8_t* data, uint32_t size) {
+    for (uint32_t n = 0; n < size; n++) {
+        if (data[n] != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static uint8_t* config_put_entry(uint8_t* out, uint8_t tag, const void* value, uint8_t size) {
+    out[0] = tag;
+    out[1] = size;
+    memcpy(out + CONFIG_TLV_OVERHEAD, value, size);
+    return out + CONFIG_TLV_OVERHEAD + size;
+}
+
+// Returns the encoded length. out must hold CONFIG_ENCODED_MAX bytes.
+static uint32_t config_encode(const config_store_t& store, uint8_t* out) {
+    uint8_t* p = out;
+
+    memcpy(p, &store.profiles[store.active_profile], CONFIG_SEGMENT_SIZE);
+    p += CONFIG_SEGMENT_SIZE;
+
+    config_schema_header_t header = {CONFIG_SCHEMA_MAGIC, CONFIG_SCHEMA_VERSION, {0, 0, 0}};
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+
+    p = config_put_entry(p, CONFIG_TAG_ACTIVE_PROFILE, &store.active_profile, 1);
+
+    for (uint8_t index = 0; index < CONFIG_PROFILE_COUNT; index++) {
+        const uint8_t* profile = (const uint8_t*)&store.profiles[index];
+
+        p = config_put_entry(p, CONFIG_TAG_PROFILE, &index, 1);
+
+        for (uint32_t f = 0; f < CONFIG_FIELD_COUNT; f++) {
+            const config_field_t& field = config_fields[f];
+
+            if (!config_is_zero(profile + field.offset, field.size)) {
+                p = config_put_entry(p, field.tag, profile + field.offset, field.size);
+            }
+        }
+    }
+
+    return p - out;
+}
+
+static const config_field_t* config_find_field(uint8_t tag) {
+    for (uint32_t f = 0; f < CONFIG_FIELD_COUNT; f++) {
+        if (config_fields[f].tag == tag) {
+            return &config_fields[f];
+        }
+    }
+
+    return nullptr;
+}
+
+// Decodes whatever layout data is in. Anything not in data reads as zero.
+static void config_decode(const uint8_t* data, uint32_t len, config_store_t& store) {
+    memset(&store, 0, sizeof(store));
+
+    config_schema_header_t header;
+    uint32_t start = CONFIG_SEGMENT_SIZE + sizeof(header);
+
+    if (len >= start) {
+        memcpy(&header, data + CONFIG_SEGMENT_SIZE, sizeof(header));
+    }
+
+    // Legacy layout
+    if (len < start || header.magic != CONFIG_SCHEMA_MAGIC) {
+        memcpy(&store, data, (len < sizeof(store)) ? len : sizeof(store));
+
+        if (len <= sizeof(config_t)) {
+            for (uint8_t index = 1; index < CONFIG_PROFILE_COUNT; index++) {
+                store.profiles[index] = store.profiles[0];
+            }
+        }
+        return;
+    }
+
+    // Entries before the first profile tag have nowhere to go
+    uint8_t* profile = nullptr;
+
+    uint32_t pos = start;
+    while (pos + CONFIG_TLV_OVERHEAD <= len) {
+        uint8_t tag = data[pos];
+        uint8_t size = data[pos + 1];
+        const uint8_t* value = data + pos + CONFIG_TLV_OVERHEAD;
+
+        if (tag == CONFIG_TAG_END || tag == CONFIG_TAG_ERASED ||
+            pos + CONFIG_TLV_OVERHEAD + size > len) {
+            break;
+        }
+
+        pos += CONFIG_TLV_OVERHEAD + size;
+
+        if (tag == CONFIG_TAG_PROFILE) {
+            profile = (size >= 1 && value[0] < CONFIG_PROFILE_COUNT) ?
+                (uint8_t*)&store.profiles[value[0]] : nullptr;
+            continue;
+        }
+
+        if (tag == CONFIG_TAG_ACTIVE_PROFILE) {
+            if (size >= 1) {
+                store.active_profile = value[0];
+            }
+            continue;
+        }
+
+        const config_field_t* field = config_find_field(tag);
+        if (field == nullptr || profile == nullptr) {
+            continue;
+        }
+
+        memset(profile + field->offset, 0, field->size);
+        memcpy(profile + field->offset, value, (size < field->size) ? size : field->size);
+    }
+}
+
+#endif
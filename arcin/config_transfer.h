@@ -0,0 +1,187 @@
+#ifndef CONFIG_TRANSFER_H
+#define CONFIG_TRANSFER_H
+
+#include <stdint.h>
+#include <string.h>
+#include "config.h"
+#include "configloader.h"
+#include "profiles.h"
+#include "mailbox.h"
+
+// Segmented config transfers (feature report 0xc1)
+//
+// Writes: the host sends segments 0, 1, 2, ... in order, each with up to
+// CONFIG_SEGMENT_SIZE bytes. The segment flagged CONFIG_SEGMENT_COMMIT is the
+// last one, and the assembled config replaces the active profile and is
+// written to flash. Any out-of-order segment aborts the transfer.
+//
+// Reads: each GET returns the segment at the read cursor and advances it, so
+// the host can read back-to-back without a SET in between. The last segment is
+// flagged CONFIG_SEGMENT_LAST and the cursor then wraps back to 0. A SET with
+// CONFIG_SEGMENT_SEEK moves the cursor without writing anything.
+//
+// Live tuning: flagging the last segment CONFIG_SEGMENT_PREVIEW instead of
+// CONFIG_SEGMENT_COMMIT applies the assembled config to the running firmware
+// without saving it. A SET with CONFIG_SEGMENT_PERSIST (and no data) later
+// saves whatever config is live into the active profile.
+
+#define CONFIG_SEGMENT_COMMIT   0x01
+#define CONFIG_SEGMENT_SEEK     0x02
+#define CONFIG_SEGMENT_PREVIEW  0x04
+#define CONFIG_SEGMENT_PERSIST  0x08
+#define CONFIG_SEGMENT_LAST     0x80
+
+#define CONFIG_SEGMENT_COUNT \
+    ((sizeof(config_t) + CONFIG_SEGMENT_SIZE - 1) / CONFIG_SEGMENT_SIZE)
+
+#define CONFIG_STATUS_REPORT_ID 0xc2
+
+// Progress of the background flash write (see Configloader)
+struct config_status_report_t {
+    uint8_t report_id;
+    uint8_t state;
+    uint8_t result;
+    uint8_t pad;
+    uint16_t write_count;
+    uint16_t erase_count;
+} __attribute__((packed));
+
+struct config_segment_report_t {
+    uint8_t report_id;
+    uint8_t segment;
+    uint8_t size;
+    uint8_t flags;
+    uint8_t data[CONFIG_SEGMENT_SIZE];
+} __attribute__((packed));
+
+class ConfigTransfer {
+    private:
+        Configloader& configloader;
+        Profiles& profiles;
+        const config_t& current;
+
+        // config being assembled from a segmented write
+        config_t staging;
+        uint8_t next_segment = 0;
+
+        uint8_t read_segment = 0;
+
+        // Start from the stored profile, so fields the host doesn't know
+        // about (or doesn't send) are preserved.
+        void begin_write() {
+            staging = profiles.store.profiles[profiles.active()];
+        }
+
+        // Profiles saves it in the background
+        bool commit() {
+            next_segment = 0;
+            profiles.set_active_config(staging);
+            return true;
+        }
+
+    public:
+        // Previewed configs, applied by the main loop
+        mailbox<config_t> previews;
+
+        ConfigTransfer(Configloader& configloader, Profiles& profiles, const config_t& current) :
+            configloader(configloader), profiles(profiles), current(current) {}
+
+        // Legacy single-segment write (feature report 0xc0). Only the first
+        // segment is replaced; the rest is kept as-is.
+        bool write_legacy(uint8_t size, const uint8_t* data) {
+            if (size > CONFIG_SEGMENT_SIZE) {
+                return false;
+            }
+
+            begin_write();
+            memcpy(&staging, data, size);
+            return commit();
+        }
+
+        bool write_segment(const config_segment_report_t* report) {
+            if (report->segment >= CONFIG_MAX_SEGMENTS ||
+                report->size > CONFIG_SEGMENT_SIZE) {
+                next_segment = 0;
+                return false;
+            }
+
+            if (report->flags & CONFIG_SEGMENT_SEEK) {
+                read_segment = report->segment;
+                return true;
+            }
+
+            if (report->flags & CONFIG_SEGMENT_PERSIST) {
+                next_segment = 0;
+                profiles.set_active_config(current);
+                return true;
+            }
+
+            if (report->segment != next_segment) {
+                next_segment = 0;
+                return false;
+            }
+
+            if (report->segment == 0) {
+                begin_write();
+            }
+
+            // Anything beyond what this firmware knows about is dropped
+            uint32_t offset = report->segment * CONFIG_SEGMENT_SIZE;
+            if (offset < sizeof(staging)) {
+                uint32_t size = report->size;
+                if (offset + size > sizeof(staging)) {
+                    size = sizeof(staging) - offset;
+                }
+
+                memcpy(((uint8_t*)&staging) + offset, report->data, size);
+            }
+
+            next_segment += 1;
+
+            if (report->flags & CONFIG_SEGMENT_COMMIT) {
+                return commit();
+            }
+
+            if (report->flags & CONFIG_SEGMENT_PREVIEW) {
+                next_segment = 0;
+                previews.post(staging);
+            }
+
+            return true;
+        }
+
+        void get_status_report(config_status_report_t* report) {
+            report->report_id = CONFIG_STATUS_REPORT_ID;
+            report->state = configloader.get_state();
+            report->result = configloader.get_result();
+            report->pad = 0;
+            report->write_count = configloader.write_count;
+            report->erase_count = configloader.erase_count;
+        }
+
+        void read_segment_report(config_segment_report_t* report) {
+            if (read_segment >= CONFIG_SEGMENT_COUNT) {
+                read_segment = 0;
+            }
+
+            uint32_t offset = read_segment * CONFIG_SEGMENT_SIZE;
+            uint32_t size = sizeof(config_t) - offset;
+            if (size > CONFIG_SEGMENT_SIZE) {
+                size = CONFIG_SEGMENT_SIZE;
+            }
+
+            memset(report, 0, sizeof(*report));
+            report->report_id = 0xc1;
+            report->segment = read_segment;
+            report->size = size;
+            memcpy(report->data, ((const uint8_t*)&current) + offset, size);
+
+            read_segment += 1;
+            if (read_segment >= CONFIG_SEGMENT_COUNT) {
+                report->flags |= CONFIG_SEGMENT_LAST;
+                read_segment = 0;
+            }
+        }
+};
+
+#endif
@@ -3,84 +3,436 @@
 
 #include <rcc/flash.h>
 #include <string.h>
+#include "crc32.h"
 
+// Config is stored as an append-only journal of records across two flash
+// pages (A and B). Each save programs a new record into the erased remainder
+// of the page holding the latest record. When that page is full, the other
+// page is erased and the record goes there instead, so the previous config
+// stays intact until the new one is complete. At boot, the valid record with
+// the highest sequence number wins, whichever page it is in.
+//
+// Record layout:
+//   header_t     magic, size | RECORD_JOURNAL
+//   data         size bytes, padded to 4
+//   trailer_t    sequence number, then the CRC32 of header, data and
+//                sequence, programmed last
+//
+// A record with a bad CRC (power lost mid-save) is skipped.
+//
+// Saves run in the background: write() only queues the data, and poll(),
+// called from the main loop, starts the erase or programs one halfword at a
+// time whenever the flash is not busy. The caller must leave the data alone
+// until busy() returns false.
+//
+// The flash has a single bank, so the CPU still stalls on instruction fetch
+// while an operation runs: briefly for a halfword program, but 20-40 ms for
+// a page erase. So a save never starts an erase itself. One that needs the
+// other page erased waits (waiting()) until the caller runs erase_spare(),
+// when a stall doesn't matter; erase_spare() can also get the erase done
+// ahead of the save.
+//
+// Page B is where the old single-record layout lived. A page in that layout
+// (no RECORD_JOURNAL flag) is read as a single record with sequence number 0.
+// The first record in a page starts with the same header, so older firmware
+// still finds a valid (if not the latest) config in page B.
 class Configloader {
     private:
         enum {
             MAGIC = 0xc0ff600d,
+            RECORD_JOURNAL = 0x80000000,
+            PAGE_SIZE = 2048,
         };
-        
+
         struct header_t {
             uint32_t magic;
             uint32_t size;
         };
-        
-        uint32_t flash_addr;
-        
-    public:
-        Configloader(uint32_t addr) : flash_addr(addr) {}
-        
-        bool read(uint32_t size, void* data) {
-            header_t* header = (header_t*)flash_addr;
-            
-            if(header->magic != MAGIC) {
+
+        struct trailer_t {
+            uint32_t sequence;
+            uint32_t crc;
+        };
+
+        struct page_scan_t {
+            // latest valid record in the page, or 0
+            uint32_t latest;
+            uint32_t sequence;
+
+            // where the next record would go
+            uint32_t append_addr;
+        };
+
+        uint32_t page_addr[2];
+
+        // Background write
+        enum state_t {
+            STATE_IDLE,
+            STATE_QUEUED,
+            STATE_ERASING,
+            STATE_PROGRAMMING,
+            STATE_WAITING,
+        };
+
+        enum result_t {
+            RESULT_NONE,
+            RESULT_OK,
+            RESULT_FAILED,
+        };
+
+        void finish(uint8_t new_result) {
+            // Lock flash.
+            FLASH.CR = 1 << 7; // LOCK
+
+            result = new_result;
+            state = STATE_IDLE;
+            erase_only = false;
+        }
+
+        volatile uint8_t state = STATE_IDLE;
+        volatile uint8_t result = RESULT_NONE;
+
+        // Erasing ahead of a save, see erase_spare()
+        bool erase_only = false;
+
+        const uint8_t* write_data;
+        uint32_t write_size;
+
+        // record being programmed, as halfwords: header, data, trailer
+        uint32_t write_addr;
+        header_t write_header;
+        trailer_t write_trailer;
+        uint32_t next_halfword;
+        uint32_t total_halfwords;
+
+        static uint32_t record_len(uint32_t size) {
+            return sizeof(header_t) + ((size + 3) & ~3) + sizeof(trailer_t);
+        }
+
+        static uint32_t record_crc(const header_t* header, const void* data, uint32_t size, uint32_t sequence) {
+            crc32_begin();
+            crc32_feed(header, sizeof(*header));
+            crc32_feed(data, size);
+            crc32_feed(&sequence, sizeof(sequence));
+            return crc32_end();
+        }
+
+        // Walks the journal in one page
+        void scan_page(uint32_t page, page_scan_t& scan) {
+            uint32_t end = page + PAGE_SIZE;
+            uint32_t addr = page;
+
+            scan.latest = 0;
+            scan.sequence = 0;
+
+            while (addr + sizeof(header_t) <= end) {
+                header_t* header = (header_t*)addr;
+
+                if (header->magic != MAGIC) {
+                    break;
+                }
+
+                // Old layout: one record, no trailer, nothing can follow it
+                if (!(header->size & RECORD_JOURNAL)) {
+                    if (addr == page) {
+                        scan.latest = addr;
+                    }
+                    addr = end;
+                    break;
+                }
+
+                uint32_t size = header->size & ~RECORD_JOURNAL;
+                if (size > PAGE_SIZE || addr + record_len(size) > end) {
+                    break;
+                }
+
+                void* data = (void*)(addr + sizeof(header_t));
+                trailer_t* trailer = (trailer_t*)(addr + record_len(size) - sizeof(trailer_t));
+                if (trailer->crc == record_crc(header, data, size, trailer->sequence) &&
+                    (scan.latest == 0 || trailer->sequence >= scan.sequence)) {
+                    scan.latest = addr;
+                    scan.sequence = trailer->sequence;
+                }
+
+                addr += record_len(size);
+            }
+
+            scan.append_addr = addr;
+        }
+
+        // Both pages; returns the index of the page with the newest record,
+        // or -1 if neither has one.
+        int scan(page_scan_t* scans) {
+            scan_page(page_addr[0], scans[0]);
+            scan_page(page_addr[1], scans[1]);
+
+            bool valid_a = scans[0].latest != 0;
+            bool valid_b = scans[1].latest != 0;
+
+            if (valid_a && (!valid_b || scans[0].sequence > scans[1].sequence)) {
+                return 0;
+            }
+
+            return valid_b ? 1 : -1;
+        }
+
+        bool is_erased(uint32_t page, uint32_t addr, uint32_t len) {
+            if (addr + len > page + PAGE_SIZE) {
                 return false;
             }
-            
-            if(header->size < size) {
-                size = header->size;
+
+            for (uint32_t n = 0; n < len; n += 4) {
+                if (*(uint32_t*)(addr + n) != 0xffffffff) {
+                    return false;
+                }
             }
-            
-            memcpy(data, (void*)(flash_addr + sizeof(header_t)), size);
-            
+
             return true;
         }
-        
-        bool write(uint32_t size, void* data) {
-            header_t header = {MAGIC, size};
-            
-            // Unlock flash.
+
+        // Address and value of the n-th halfword of the record. The padding
+        // after the data is left erased.
+        void get_halfword(uint32_t n, uint16_t*& dest, uint16_t& value) {
+            uint32_t header_halfwords = sizeof(header_t) / 2;
+            uint32_t data_halfwords = (write_size + 1) / 2;
+
+            if (n < header_halfwords) {
+                dest = (uint16_t*)write_addr + n;
+                value = ((uint16_t*)&write_header)[n];
+                return;
+            }
+            n -= header_halfwords;
+
+            if (n < data_halfwords) {
+                dest = (uint16_t*)(write_addr + sizeof(header_t)) + n;
+                value = ((uint16_t*)write_data)[n];
+                return;
+            }
+            n -= data_halfwords;
+
+            // sequence, then the CRC last, so a torn record is never used
+            dest = (uint16_t*)(write_addr + record_len(write_size) - sizeof(trailer_t)) + n;
+            value = ((uint16_t*)&write_trailer)[n];
+        }
+
+        void begin() {
+            page_scan_t scans[2];
+            int newest = scan(scans);
+
+            // Nothing changed, save the flash the trouble
+            if (newest >= 0) {
+                header_t* header = (header_t*)scans[newest].latest;
+                if (header->size == (write_size | RECORD_JOURNAL) &&
+                    memcmp((void*)(scans[newest].latest + sizeof(header_t)), write_data, write_size) == 0) {
+                    result = RESULT_OK;
+                    state = STATE_IDLE;
+                    return;
+                }
+            }
+
+            // Keep appending to the page with the newest record
+            int page = (newest >= 0) ? newest : 1;
+            uint32_t sequence = (newest >= 0) ? scans[newest].sequence + 1 : 1;
+
+            write_addr = scans[page].append_addr;
+            write_header = {MAGIC, write_size | RECORD_JOURNAL};
+            write_trailer = {
+                sequence,
+                record_crc(&write_header, write_data, write_size, sequence)};
+            next_halfword = 0;
+            total_halfwords =
+                (sizeof(header_t) + sizeof(trailer_t)) / 2 + (write_size + 1) / 2;
+
+            if (is_erased(page_addr[page], write_addr, record_len(write_size))) {
+                unlock();
+                state = STATE_PROGRAMMING;
+                return;
+            }
+
+            // Full (or damaged); start over in the other page
+            page = 1 - page;
+            write_addr = page_addr[page];
+
+            // Already erased by erase_spare()
+            if (is_erased(page_addr[page], page_addr[page], PAGE_SIZE)) {
+                unlock();
+                state = STATE_PROGRAMMING;
+                return;
+            }
+
+            // Until erase_spare() erases it
+            state = STATE_WAITING;
+        }
+
+        void unlock() {
             FLASH.KEYR = 0x45670123;
             FLASH.KEYR = 0xCDEF89AB;
-            
-            // Erase page.
+        }
+
+        void erase(uint32_t page) {
             FLASH.CR = 1 << 1; // PER
-            FLASH.AR = flash_addr;
+            FLASH.AR = page;
             FLASH.CR = (1 << 6) | (1 << 1); // STRT, PER
-            
-            while(FLASH.SR & (1 << 0)); // BSY
-            
-            FLASH.SR &= ~(1 << 5); // EOP
-            FLASH.CR = 0;
-            
-            // Write header.
-            uint16_t* src = (uint16_t*)&header;
-            uint16_t* dest = (uint16_t*)flash_addr;
-            
-            for(uint32_t n = 0; n < sizeof(header); n += 2) {
-                FLASH.CR = 1 << 0; // PG
-                
-                *dest++ = *src++;
-                
-                while(FLASH.SR & (1 << 0)); // BSY
-            }
-            
-            // Write data.
-            src = (uint16_t*)data;
-            
-            for(uint32_t n = 0; n < size; n += 2) {
-                FLASH.CR = 1 << 0; // PG
-                
-                *dest++ = *src++;
-                
-                while(FLASH.SR & (1 << 0)); // BSY
+
+            erase_count += 1;
+            state = STATE_ERASING;
+        }
+
+    public:
+        // instrumentation
+        uint32_t erase_count = 0;
+        uint32_t write_count = 0;
+        uint32_t poll_count = 0;
+
+        Configloader(uint32_t addr_a, uint32_t addr_b) : page_addr{addr_a, addr_b} {}
+
+        // Returns the number of bytes read, 0 if there is no config.
+        // crc32_init() must have been called.
+        uint32_t read(uint32_t size, void* data) {
+            page_scan_t scans[2];
+            int newest = scan(scans);
+
+            if(newest < 0) {
+                return 0;
             }
-            
-            // Lock flash.
-            FLASH.CR = 1 << 7; // LOCK
-            
+
+            uint32_t addr = scans[newest].latest;
+            header_t* header = (header_t*)addr;
+            uint32_t stored_size = header->size & ~RECORD_JOURNAL;
+
+            if(stored_size < size) {
+                size = stored_size;
+            }
+
+            memcpy(data, (void*)(addr + sizeof(header_t)), size);
+
+            return size;
+        }
+
+        // Queues a save. Safe to call from an interrupt.
+        bool write(uint32_t size, const void* data) {
+            if (busy() || record_len(size) > PAGE_SIZE) {
+                return false;
+            }
+
+            write_data = (const uint8_t*)data;
+            write_size = size;
+            result = RESULT_NONE;
+            state = STATE_QUEUED;
+
+            return true;
+        }
+
+        bool busy() {
+            return state != STATE_IDLE;
+        }
+
+        // A save is held until erase_spare() erases the page it goes to
+        bool waiting() {
+            return state == STATE_WAITING;
+        }
+
+        // Starts erasing the page a waiting save goes to. When idle, does
+        // the same ahead of time if the page with the latest record has no
+        // room for another record of the same size. Returns whether it
+        // started an erase. poll() finishes the erase (and a waiting save);
+        // busy() is true until then.
+        bool erase_spare() {
+            if (state == STATE_WAITING) {
+                unlock();
+                erase(write_addr);
+                return true;
+            }
+
+            if (state != STATE_IDLE) {
+                return false;
+            }
+
+            page_scan_t scans[2];
+            int newest = scan(scans);
+            if (newest < 0) {
+                return false;
+            }
+
+            header_t* header = (header_t*)scans[newest].latest;
+            uint32_t size = header->size & ~RECORD_JOURNAL;
+            uint32_t spare = page_addr[1 - newest];
+
+            if (is_erased(page_addr[newest], scans[newest].append_addr, record_len(size)) ||
+                is_erased(spare, spare, PAGE_SIZE)) {
+                return false;
+            }
+
+            unlock();
+
+            erase_only = true;
+            erase(spare);
             return true;
         }
+
+        // 0 = idle, 1 = queued, 2 = erasing, 3 = programming, 4 = waiting
+        // for erase_spare()
+        uint8_t get_state() {
+            return state;
+        }
+
+        // Outcome of the last save: 0 = none yet, 1 = ok, 2 = failed
+        uint8_t get_result() {
+            return result;
+        }
+
+        // Advances a queued save by at most one flash operation, without
+        // waiting for it to finish. Main loop only.
+        void poll() {
+            if (state == STATE_IDLE || state == STATE_WAITING) {
+                return;
+            }
+
+            if (state == STATE_QUEUED) {
+                begin();
+                return;
+            }
+
+            if (FLASH.SR & (1 << 0)) { // BSY
+                return;
+            }
+
+            poll_count += 1;
+
+            if (FLASH.SR & ((1 << 2) | (1 << 4))) { // PGERR, WRPRTERR
+                FLASH.SR = (1 << 2) | (1 << 4);
+                finish(RESULT_FAILED);
+                return;
+            }
+
+            if (state == STATE_ERASING) {
+                FLASH.SR &= ~(1 << 5); // EOP
+                FLASH.CR = 0;
+                state = STATE_PROGRAMMING;
+
+                // Not a save, so the result of the last one stands
+                if (erase_only) {
+                    erase_only = false;
+                    FLASH.CR = 1 << 7; // LOCK
+                    state = STATE_IDLE;
+                }
+                return;
+            }
+
+            if (next_halfword < total_halfwords) {
+                uint16_t* dest;
+                uint16_t value;
+                get_halfword(next_halfword++, dest, value);
+
+                FLASH.CR = 1 << 0; // PG
+
+                *dest = value;
+                return;
+            }
+
+            write_count += 1;
+            finish(RESULT_OK);
+        }
 };
 
 #endif
@@ -0,0 +1,107 @@
+#ifndef CRC32_DEFINES_H
+#define CRC32_DEFINES_H
+
+#include <stdint.h>
+
+// Standard CRC-32 (as used by zlib, Ethernet): polynomial 0x04c11db7,
+// reflected input and output, initial value and final xor 0xffffffff.
+//
+// On target this uses the CRC unit. Define CRC32_SOFTWARE to get the bitwise
+// implementation instead, which gives identical results (e.g. for host builds).
+
+#define CRC32_INIT 0xffffffff
+
+// Bitwise, no table, to keep it small
+static inline uint32_t crc32_update_sw(uint32_t crc, const void* data, uint32_t len) {
+    const uint8_t* p = (const uint8_t*)data;
+
+    for (uint32_t n = 0; n < len; n++) {
+        crc ^= p[n];
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+        }
+    }
+
+    return crc;
+}
+
+// crc32_begin(), any number of crc32_feed(), then crc32_end(). Not
+// reentrant; main loop (or boot) only.
+
+#ifdef CRC32_SOFTWARE
+
+static uint32_t crc32_sw_state;
+
+static inline void crc32_init() {}
+
+static inline void crc32_begin() {
+    crc32_sw_state = CRC32_INIT;
+}
+
+static inline void crc32_feed(const void* data, uint32_t len) {
+    crc32_sw_state = crc32_update_sw(crc32_sw_state, data, len);
+}
+
+static inline uint32_t crc32_end() {
+    return crc32_sw_state ^ 0xffffffff;
+}
+
+#else
+
+#include <rcc/rcc.h>
+
+struct CRC_reg_t {
+    volatile uint32_t DR;
+    volatile uint32_t IDR;
+    volatile uint32_t CR;
+    uint32_t _reserved;
+    volatile uint32_t INIT;
+    volatile uint32_t POL;
+};
+
+static CRC_reg_t& CRC_unit = *(CRC_reg_t*)0x40023000;
+
+// Call once before using crc32()
+static inline void crc32_init() {
+    RCC.enable(RCC.CRC);
+
+    CRC_unit.POL = 0x04c11db7;
+    CRC_unit.INIT = CRC32_INIT;
+}
+
+static inline void crc32_begin() {
+    CRC_unit.CR = (1 << 7) | (1 << 0); // REV_OUT, RESET
+}
+
+static inline void crc32_feed(const void* data, uint32_t len) {
+    const uint8_t* p = (const uint8_t*)data;
+
+    // Whole words where possible. Reversing the input by word makes the
+    // first byte in memory go in first, LSB first.
+    CRC_unit.CR = (1 << 7) | (3 << 5); // REV_OUT, REV_IN word
+
+    for (; len >= 4 && ((uint32_t)p & 3) == 0; len -= 4, p += 4) {
+        CRC_unit.DR = *(const uint32_t*)p;
+    }
+
+    // The rest a byte at a time
+    CRC_unit.CR = (1 << 7) | (1 << 5); // REV_OUT, REV_IN byte
+
+    for (; len > 0; len--, p++) {
+        *(volatile uint8_t*)&CRC_unit.DR = *p;
+    }
+}
+
+static inline uint32_t crc32_end() {
+    return CRC_unit.DR ^ 0xffffffff;
+}
+
+#endif
+
+static inline uint32_t crc32(const void* data, uint32_t len) {
+    crc32_begin();
+    crc32_feed(data, len);
+    return crc32_end();
+}
+
+#endif
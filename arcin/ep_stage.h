@@ -0,0 +1,94 @@
+#ifndef EP_STAGE_DEFINES_H
+#define EP_STAGE_DEFINES_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define EP_STAGE_MAX_LEN 16
+
+// Counts put()s, to order reports waiting for the same endpoint
+static uint32_t ep_stage_clock;
+
+// Holds the latest report for an IN endpoint that was still busy with the
+// previous one. The USB interrupt hands it to the endpoint as soon as the
+// previous report has been picked up, so the next report is already waiting
+// when the host polls again.
+class ep_stage {
+private:
+    uint32_t buf[EP_STAGE_MAX_LEN / sizeof(uint32_t)];
+    uint32_t len;
+    bool pending;
+
+    // ep_stage_clock when the pending report was first staged
+    uint32_t staged_at;
+
+public:
+    // In single-interface mode, keyboard reports go out on the gamepad
+    // endpoint
+    uint8_t ep;
+
+    // instrumentation
+    uint32_t written_directly = 0;
+    uint32_t written_from_stage = 0;
+
+    ep_stage(uint8_t ep) : len(0), pending(false), ep(ep) {}
+
+    // A newer report replaces a staged one, but keeps its place in line
+    void put(const void* report, uint32_t report_len) {
+        if (report_len > EP_STAGE_MAX_LEN) {
+            report_len = EP_STAGE_MAX_LEN;
+        }
+
+        memcpy(buf, report, report_len);
+        len = report_len;
+
+        if (!pending) {
+            staged_at = ep_stage_clock++;
+        }
+        pending = true;
+    }
+
+    // Whether this has a report for ep that was staged before other's
+    bool waiting_before(uint8_t for_ep, const ep_stage& other) {
+        if (!pending || ep != for_ep) {
+            return false;
+        }
+
+        return !other.pending || other.ep != for_ep ||
+            (int32_t)(staged_at - other.staged_at) < 0;
+    }
+
+    // Returns the staged report, if any, and empties the stage
+    bool take(uint32_t*& report, uint32_t& report_len) {
+        if (!pending) {
+            return false;
+        }
+
+        pending = false;
+        report = buf;
+        report_len = len;
+        return true;
+    }
+
+    void clear() {
+        pending = false;
+    }
+};
+
+// The stage with the report that has waited longest for ep, or nullptr. In
+// single-interface mode the gamepad and keyboard share an endpoint, and take
+// turns this way, so that a gamepad report refilled every loop iteration
+// can't hold keyboard reports back.
+static inline ep_stage* ep_stage_next(uint8_t ep, ep_stage& a, ep_stage& b) {
+    if (a.waiting_before(ep, b)) {
+        return &a;
+    }
+
+    if (b.waiting_before(ep, a)) {
+        return &b;
+    }
+
+    return nullptr;
+}
+
+#endif
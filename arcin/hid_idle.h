@@ -0,0 +1,92 @@
+#ifndef HID_IDLE_DEFINES_H
+#define HID_IDLE_DEFINES_H
+
+#include <stdint.h>
+#include <string.h>
+#include <os/time.h>
+
+// Largest input report we keep a copy of for change detection
+#define HID_IDLE_MAX_REPORT_LEN 16
+
+// Tracks the HID idle rate for an input endpoint and decides whether a report
+// needs to go out. A report is sent when it differs from the last one sent,
+// or when the idle period (set by the host through SET_IDLE) has elapsed.
+class hid_idle {
+private:
+    uint8_t last_report[HID_IDLE_MAX_REPORT_LEN];
+    uint8_t last_len;
+    bool last_valid;
+
+    // in units of 4ms, as defined by the HID spec. 0 = only send on change
+    uint8_t default_rate;
+    uint8_t idle_rate;
+
+    uint32_t last_sent_time;
+    uint32_t last_suppressed_time;
+
+public:
+    // instrumentation
+    uint32_t reports_sent;
+    uint32_t reports_suppressed;
+
+    hid_idle(uint8_t default_rate) : default_rate(default_rate) {
+        reset();
+        reports_sent = 0;
+        reports_suppressed = 0;
+    }
+
+    // Called when the host (re)configures the device. The next report is
+    // always sent.
+    void reset() {
+        last_len = 0;
+        last_valid = false;
+        idle_rate = default_rate;
+        last_sent_time = 0;
+        last_suppressed_time = 0;
+    }
+
+    void set_idle_rate(uint8_t rate) {
+        idle_rate = rate;
+    }
+
+    uint8_t get_idle_rate() {
+        return idle_rate;
+    }
+
+    // Called with each newly built report. Returns true if the report should
+    // be sent, and records it as sent.
+    bool should_send(const void* report, uint8_t len) {
+        uint32_t now = Time::time();
+
+        if (len > HID_IDLE_MAX_REPORT_LEN) {
+            len = HID_IDLE_MAX_REPORT_LEN;
+        }
+
+        bool changed =
+            !last_valid ||
+            (len != last_len) ||
+            (memcmp(last_report, report, len) != 0);
+
+        bool idle_expired =
+            (idle_rate != 0) &&
+            ((now - last_sent_time) >= ((uint32_t)idle_rate * 4));
+
+        if (!changed && !idle_expired) {
+            // count at most one suppressed report per frame
+            if (now != last_suppressed_time) {
+                last_suppressed_time = now;
+                reports_suppressed += 1;
+            }
+            return false;
+        }
+
+        memcpy(last_report, report, len);
+        last_len = len;
+        last_valid = true;
+        last_sent_time = now;
+        reports_sent += 1;
+        return true;
+    }
+};
+
+#endif
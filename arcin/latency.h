@@ -0,0 +1,230 @@
+#ifndef LATENCY_DEFINES_H
+#define LATENCY_DEFINES_H
+
+#include <stdint.h>
+#include <string.h>
+#include <usb/usb.h>
+#include "timer.h"
+
+// Completed gamepad reports waiting to go out with telemetry
+#define LATENCY_QUEUE_LEN       8
+
+// Output and input report on the telemetry interface
+#define ECHO_REPORT_ID          0x05
+
+// USB frame number (SOF count, 11 bits)
+static inline uint16_t usb_frame_number() {
+    return USB.reg.FNR & 0x7ff;
+}
+
+// Timestamps for one gamepad input report. Times after sampling are offsets
+// from sample_us, saturating at 65535.
+struct latency_event_t {
+    uint8_t sequence;
+    uint8_t axis_x;
+    uint16_t buttons;
+
+    // when the inputs in this report were sampled
+    uint32_t sample_us;
+
+    // when the report was loaded into the endpoint
+    uint16_t write_delay_us;
+
+    // when the endpoint completed the IN transfer, i.e. the host has the report
+    uint16_t sent_delay_us;
+
+    // USB frame numbers of sampling and completion
+    uint16_t sample_frame;
+    uint16_t sent_frame;
+} __attribute__((packed));
+
+struct echo_request_t {
+    uint8_t report_id;
+    uint32_t token;
+} __attribute__((packed));
+
+struct echo_report_t {
+    uint8_t report_id;
+    uint32_t token;
+
+    // when the request arrived
+    uint32_t received_us;
+    uint16_t received_frame;
+
+    // when the echo was handed to the endpoint; the host collects it at the
+    // next IN transfer
+    uint16_t sent_frame;
+    uint16_t turnaround_us;
+} __attribute__((packed));
+
+// Must fit the telemetry endpoint
+static_assert(sizeof(echo_report_t) <= 64, "echo report too large");
+
+// Echoes a host token back on the telemetry endpoint, so that a host tool can
+// measure the USB round trip (through hubs, host controller and OS) separately
+// from input processing, without holding up gamepad reports. Both ends run in
+// the USB interrupt. Not available in single-interface mode, which has no
+// telemetry interface.
+class LatencyEcho {
+    private:
+        echo_report_t report;
+        bool pending = false;
+
+    public:
+        // instrumentation
+        uint32_t requests = 0;
+        uint32_t dropped = 0;
+
+        // A request that arrives before the previous echo went out replaces it
+        void received(uint32_t token) {
+            if (pending) {
+                dropped += 1;
+            }
+
+            report.report_id = ECHO_REPORT_ID;
+            report.token = token;
+            report.received_us = time_us();
+            report.received_frame = usb_frame_number();
+            pending = true;
+            requests += 1;
+        }
+
+        // Returns the echo to write to the (free) endpoint, if any
+        echo_report_t* take() {
+            if (!pending) {
+                return nullptr;
+            }
+
+            pending = false;
+            report.sent_frame = usb_frame_number();
+            report.turnaround_us = time_us() - report.received_us;
+            return &report;
+        }
+};
+
+// Tags each gamepad report with the device time and USB frame number at
+// which its inputs were sampled, loaded into the endpoint and picked up by
+// the host, so that a host tool can line them up with OS input timestamps.
+// Every report that reaches the host gets an event; they are streamed with
+// the telemetry reports.
+//
+// The main loop calls sampled() and queued(); everything else runs with the
+// USB interrupt locked out, or in it.
+class LatencyTracker {
+    private:
+        uint8_t sequence;
+
+        // sample time of the current loop iteration
+        uint16_t sample_frame;
+        uint32_t sample_us;
+
+        // report built by the main loop, possibly still staged
+        latency_event_t queued_event;
+        bool queued_valid;
+
+        // report in the endpoint
+        latency_event_t in_flight;
+        bool in_flight_valid;
+
+        // completed, oldest first
+        latency_event_t events[LATENCY_QUEUE_LEN];
+        uint8_t head;
+        uint8_t count;
+
+        static uint16_t delay_since(uint32_t start_us) {
+            uint32_t delay = time_us() - start_us;
+            return (delay > UINT16_MAX) ? UINT16_MAX : delay;
+        }
+
+    public:
+        bool enabled = false;
+
+        // instrumentation: events lost to a full queue
+        uint32_t dropped = 0;
+
+        void enable(bool on) {
+            sequence = 0;
+            queued_valid = false;
+            in_flight_valid = false;
+            head = 0;
+            count = 0;
+            enabled = on;
+        }
+
+        // The endpoint was reset; whatever was in it is gone
+        void cancel() {
+            queued_valid = false;
+            in_flight_valid = false;
+        }
+
+        // Right before the inputs are read
+        void sampled() {
+            if (!enabled) {
+                return;
+            }
+
+            sample_frame = usb_frame_number();
+            sample_us = time_us();
+        }
+
+        // A gamepad report was built from the latest sample. Replaces an
+        // earlier one that never made it to the endpoint.
+        void queued(uint16_t buttons, uint8_t axis_x) {
+            if (!enabled) {
+                return;
+            }
+
+            queued_event.sequence = sequence++;
+            queued_event.axis_x = axis_x;
+            queued_event.buttons = buttons;
+            queued_event.sample_us = sample_us;
+            queued_event.sample_frame = sample_frame;
+            queued_valid = true;
+        }
+
+        // The queued gamepad report was written to the endpoint
+        void loaded() {
+            if (!enabled || !queued_valid) {
+                return;
+            }
+
+            in_flight = queued_event;
+            in_flight.write_delay_us = delay_since(in_flight.sample_us);
+            in_flight_valid = true;
+            queued_valid = false;
+        }
+
+        // The gamepad endpoint is free: the report in it, if any, was sent
+        void completed() {
+            if (!enabled || !in_flight_valid) {
+                return;
+            }
+
+            in_flight_valid = false;
+            in_flight.sent_delay_us = delay_since(in_flight.sample_us);
+            in_flight.sent_frame = usb_frame_number();
+
+            if (count == LATENCY_QUEUE_LEN) {
+                dropped += 1;
+                return;
+            }
+
+            events[(head + count) % LATENCY_QUEUE_LEN] = in_flight;
+            count += 1;
+        }
+
+        // Takes up to max completed events, oldest first
+        uint8_t take(latency_event_t* out, uint8_t max) {
+            uint8_t n = 0;
+
+            for (; n < max && count; n++) {
+                out[n] = events[head];
+                head = (head + 1) % LATENCY_QUEUE_LEN;
+                count -= 1;
+            }
+
+            return n;
+        }
+};
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef MAILBOX_DEFINES_H
+#define MAILBOX_DEFINES_H
+
+#include <stdint.h>
+
+// Single-slot, latest-value-wins mailbox. The producer (USB request handling)
+// posts values; the consumer (main loop) takes the latest one when it is
+// ready to apply it. Values overwritten before being taken are counted.
+template <typename T>
+class mailbox {
+private:
+    T value;
+    bool full = false;
+
+public:
+    // instrumentation
+    uint32_t posted = 0;
+    uint32_t coalesced = 0;
+
+    void post(const T& new_value) {
+        if (full) {
+            coalesced += 1;
+        }
+
+        value = new_value;
+        full = true;
+        posted += 1;
+    }
+
+    bool take(T& out) {
+        if (!full) {
+            return false;
+        }
+
+        out = value;
+        full = false;
+        return true;
+    }
+};
+
+#endif
@@ -10,6 +10,8 @@
 #include "usb_strings.h"
 #include "configloader.h"
 #include "config.h"
+#include "config_transfer.h"
+#include "profiles.h"
 
 #include "inf_defines.h"
 #include "remap.h"
@@ -17,7 +19,16 @@
 #include "debounce.h"
 #include "modeswitch.h"
 #include "analog_button.h"
+#include "tt_accel.h"
+#include "hid_idle.h"
+#include "nkro.h"
+#include "telemetry.h"
+#include "latency.h"
+#include "mailbox.h"
+#include "ep_stage.h"
 #include "rgbmanager.h"
+#include "runtime_plan.h"
+#include "bootslot.h"
 
 #define DEBUG_TIMING_GAMEPAD 0
 
@@ -45,8 +56,9 @@ static const uint16_t infinitas_keys[] = {
 
 static uint32_t& reset_reason = *(uint32_t*)0x10000000;
 
-static bool do_reset_bootloader;
-static bool do_reset;
+// Set from USB interrupt context
+static volatile bool do_reset_bootloader;
+static volatile bool do_reset;
 
 void reset() {
     SCB.AIRCR = (0x5fa << 16) | (1 << 2); // SYSRESETREQ
@@ -57,10 +69,61 @@ void reset_bootloader() {
     reset();
 }
 
-Configloader configloader(0x801f800);
+// A/B config pages, right after the firmware (see arcin.ld)
+Configloader configloader(0x801f000, 0x801f800);
 
+// How long the controller must sit untouched before the config page the
+// next save needs is erased ahead of time
+#define SPARE_ERASE_IDLE_MS 3000
+
+// The bootloader boots a freshly flashed slot on trial; once this firmware
+// has run long enough, mark its slot good so it keeps booting. Flash must be
+// idle (a config save waiting for its erase leaves it alone).
+static bool slot_confirmed;
+
+// Tells the bootloader that this firmware confirms its slot, so it boots on
+// trial (see bootslot.h)
+const uint32_t slot_marker[2] = {SLOT_MARKER_0, SLOT_MARKER_1};
+
+void confirm_slot() {
+    slot_confirmed = true;
+
+    // Referenced here, so the marker isn't dropped from the image
+    if (*(const volatile uint32_t*)slot_marker != SLOT_MARKER_0) {
+        return;
+    }
+
+    for (uint32_t slot = 0; slot < SLOT_COUNT; slot++) {
+        if (SCB.VTOR != boot_slots[slot].start) {
+            continue;
+        }
+
+        const slot_info_t* info = slot_info(slot);
+
+        if (info->complete != SLOT_COMPLETE || info->confirmed == SLOT_FLAG_SET) {
+            return;
+        }
+
+        // Unlock flash.
+        FLASH.KEYR = 0x45670123;
+        FLASH.KEYR = 0xCDEF89AB;
+
+        FLASH.CR = 1 << 0; // PG
+        *(volatile uint16_t*)&info->confirmed = SLOT_FLAG_SET;
+        while (FLASH.SR & (1 << 0)); // BSY
+
+        // Lock flash.
+        FLASH.CR = 1 << 7; // LOCK
+    }
+}
+
+// Live config: a copy of the active profile
 config_t config;
 
+Profiles profiles(configloader, config);
+
+ConfigTransfer config_transfer(configloader, profiles, config);
+
 /* 
  // origial hardware ID for arcin - expected by firmware flash
  // and the settings tool
@@ -84,38 +147,83 @@ auto dev_desc = device_desc(
     STRING_ID_Serial,
     1);     // bNumConfigurations
 
-auto conf_desc_1000hz = configuration_desc(2, 1, 0, 0xc0, 0,
-    // HID interface.
-    interface_desc(0, 0, 1, 0x03, 0x00, 0x00, 0,
-        hid_desc(0x111, 0, 1, 0x22, sizeof(report_desc)),
-        endpoint_desc(0x81, 0x03, 16, 1)
-    ),
-    interface_desc(1, 0, 1, 0x03, 0x00, 0x00, 0,
-        hid_desc(0x111, 0, 1, 0x22, sizeof(keyb_report_desc)),
-        endpoint_desc(0x82, 0x03, 16, 1)
-    )
-);
-
-auto conf_desc_250hz = configuration_desc(2, 1, 0, 0xc0, 0,
-    // HID interface.
-    interface_desc(0, 0, 1, 0x03, 0x00, 0x00, 0,
-        hid_desc(0x111, 0, 1, 0x22, sizeof(report_desc)),
-        endpoint_desc(0x81, 0x03, 16, 4)
-    ),
-    interface_desc(1, 0, 1, 0x03, 0x00, 0x00, 0,
-        hid_desc(0x111, 0, 1, 0x22, sizeof(keyb_report_desc)),
-        endpoint_desc(0x82, 0x03, 16, 4)
-    )
-);
+constexpr auto arcin_conf_desc(uint8_t interval, uint16_t keyb_report_desc_size) -> decltype(
+    configuration_desc(3, 1, 0, 0xc0, 0,
+        interface_desc(0, 0, 1, 0x03, 0x00, 0x00, 0,
+            hid_desc(0x111, 0, 1, 0x22, sizeof(report_desc)),
+            endpoint_desc(0x81, 0x03, 16, interval)
+        ),
+        interface_desc(1, 0, 1, 0x03, 0x00, 0x00, 0,
+            hid_desc(0x111, 0, 1, 0x22, keyb_report_desc_size),
+            endpoint_desc(0x82, 0x03, 16, interval)
+        ),
+        interface_desc(2, 0, 1, 0x03, 0x00, 0x00, 0,
+            hid_desc(0x111, 0, 1, 0x22, sizeof(telemetry_report_desc)),
+            endpoint_desc(0x83, 0x03, 64, 1)
+        )
+    )) {
+    return configuration_desc(3, 1, 0, 0xc0, 0,
+        // HID interface.
+        interface_desc(0, 0, 1, 0x03, 0x00, 0x00, 0,
+            hid_desc(0x111, 0, 1, 0x22, sizeof(report_desc)),
+            endpoint_desc(0x81, 0x03, 16, interval)
+        ),
+        interface_desc(1, 0, 1, 0x03, 0x00, 0x00, 0,
+            hid_desc(0x111, 0, 1, 0x22, keyb_report_desc_size),
+            endpoint_desc(0x82, 0x03, 16, interval)
+        ),
+        interface_desc(2, 0, 1, 0x03, 0x00, 0x00, 0,
+            hid_desc(0x111, 0, 1, 0x22, sizeof(telemetry_report_desc)),
+            endpoint_desc(0x83, 0x03, 64, 1)
+        )
+    );
+}
+
+// Single-interface mode (config.flags.SingleInterface)
+constexpr auto arcin_combined_conf_desc(uint8_t interval) -> decltype(
+    configuration_desc(1, 1, 0, 0xc0, 0,
+        interface_desc(0, 0, 1, 0x03, 0x00, 0x00, 0,
+            hid_desc(0x111, 0, 1, 0x22, sizeof(combined_report_desc)),
+            endpoint_desc(0x81, 0x03, 16, interval)
+        )
+    )) {
+    return configuration_desc(1, 1, 0, 0xc0, 0,
+        // HID interface, gamepad and keyboard.
+        interface_desc(0, 0, 1, 0x03, 0x00, 0x00, 0,
+            hid_desc(0x111, 0, 1, 0x22, sizeof(combined_report_desc)),
+            endpoint_desc(0x81, 0x03, 16, interval)
+        )
+    );
+}
+
+union arcin_conf_desc_t {
+    decltype(arcin_conf_desc(1, 0)) split;
+    decltype(arcin_combined_conf_desc(1)) combined;
+};
+
+static_assert(
+    sizeof(arcin_conf_desc_t::combined) <= sizeof(arcin_conf_desc_t::split),
+    "combined configuration descriptor must fit");
+
+// Rewritten in place by usb_attach() for the selected layout, polling interval
+// and keyboard report.
+arcin_conf_desc_t conf_desc = { arcin_conf_desc(1, sizeof(keyb_report_desc)) };
 
 desc_t dev_desc_p = {sizeof(dev_desc), (void*)&dev_desc};
 
-desc_t conf_desc_p_1000hz = {sizeof(conf_desc_1000hz), (void*)&conf_desc_1000hz};
-desc_t conf_desc_p_250hz = {sizeof(conf_desc_250hz), (void*)&conf_desc_250hz};
+// Size of the selected layout, set by usb_select_layout(). The combined
+// layout is shorter than the union; anything past it is stale.
+desc_t conf_desc_p = {sizeof(conf_desc.split), (void*)&conf_desc};
 
 desc_t report_desc_p = {sizeof(report_desc), (void*)&report_desc};
+desc_t combined_report_desc_p =
+    {sizeof(combined_report_desc), (void*)&combined_report_desc};
 desc_t keyb_report_desc_p =
     {sizeof(keyb_report_desc), (void*)&keyb_report_desc};
+desc_t keyb_nkro_report_desc_p =
+    {sizeof(keyb_nkro_report_desc), (void*)&keyb_nkro_report_desc};
+desc_t telemetry_report_desc_p =
+    {sizeof(telemetry_report_desc), (void*)&telemetry_report_desc};
 
 static Pin usb_dm = GPIOA[11];
 static Pin usb_dp = GPIOA[12];
@@ -136,8 +244,184 @@ static Pin qe2b = GPIOA[7];
 static Pin led1 = GPIOA[8];
 static Pin led2 = GPIOA[9];
 
-USB_f1 usb_1000hz(USB, dev_desc_p, conf_desc_p_1000hz);
-USB_f1 usb_250hz(USB, dev_desc_p, conf_desc_p_250hz);
+USB_f1 usb(USB, dev_desc_p, conf_desc_p);
+
+uint16_t keyb_report_desc_size = sizeof(keyb_report_desc);
+bool keyboard_nkro = false;
+
+// Gamepad and keyboard share interface 0 / EP 0x81
+bool usb_combined = false;
+uint8_t usb_poll_interval = 1;
+
+// Pull-up is off while re-enumerating
+bool usb_detached = false;
+timer usb_detach_timer;
+
+// Reports built while the gamepad / keyboard endpoint was busy
+ep_stage gamepad_stage(1);
+ep_stage keyboard_stage(2);
+
+LatencyEcho latency_echo;
+
+Telemetry telemetry;
+LatencyTracker latency;
+
+// All writes to the report endpoints go through here, with the USB interrupt
+// locked out or from it. The endpoint is free, so whatever was in it before
+// has been sent.
+void usb_write_report(ep_stage& stage, const void* report, uint32_t len) {
+    if (stage.ep == 1) {
+        latency.completed();
+    }
+
+    usb.write(stage.ep, (uint32_t*)report, len);
+
+    if (&stage == &gamepad_stage) {
+        latency.loaded();
+    }
+}
+
+// Writes the staged report that has waited longest for the endpoint, if the
+// endpoint is free
+void usb_flush_ep(uint8_t ep) {
+    ep_stage* stage = ep_stage_next(ep, gamepad_stage, keyboard_stage);
+    if (!stage || !usb.ep_ready(ep)) {
+        return;
+    }
+
+    uint32_t* report;
+    uint32_t len;
+    if (stage->take(report, len)) {
+        usb_write_report(*stage, report, len);
+        stage->written_from_stage += 1;
+    }
+}
+
+// USB events (enumeration, control transfers, endpoint completion) are handled
+// here rather than in the main loop.
+template <>
+void interrupt<Interrupt::USB_LP_CAN_RX0>() {
+    usb.process();
+
+    // An IN transfer may have just completed; refill the endpoint right away
+    // instead of waiting for the main loop to notice.
+    if (!usb_detached) {
+        if (usb.ep_ready(1)) {
+            // Timestamped here, as the interrupt runs on completion
+            latency.completed();
+        }
+
+        usb_flush_ep(1);
+        usb_flush_ep(2);
+
+        // A pending echo goes ahead of telemetry, so that it measures the USB
+        // round trip only
+        if (usb.ep_ready(3)) {
+            echo_report_t* echo = latency_echo.take();
+            if (echo) {
+                usb.write(3, (uint32_t*)echo, sizeof(*echo));
+            }
+        }
+    }
+}
+
+// Keeps the USB interrupt from running while the main loop touches endpoint
+// registers or state shared with the HID classes.
+class usb_irq_lock {
+    public:
+        usb_irq_lock() {
+            Interrupt::disable(Interrupt::USB_LP_CAN_RX0);
+        }
+
+        ~usb_irq_lock() {
+            Interrupt::enable(Interrupt::USB_LP_CAN_RX0);
+        }
+};
+
+bool usb_ep_ready(uint32_t ep) {
+    if (usb_detached) {
+        return false;
+    }
+
+    usb_irq_lock lock;
+    return usb.ep_ready(ep);
+}
+
+void usb_select_layout();
+
+// Also enables the USB interrupt (when the lock is released) the first time
+void usb_attach(uint8_t poll_interval) {
+    {
+        usb_irq_lock lock;
+
+        usb_select_layout();
+
+        if (usb_combined) {
+            conf_desc.combined = arcin_combined_conf_desc(poll_interval);
+        } else {
+            conf_desc.split = arcin_conf_desc(poll_interval, keyb_report_desc_size);
+        }
+        usb_poll_interval = poll_interval;
+
+        gamepad_stage.clear();
+        keyboard_stage.clear();
+        latency.cancel();
+
+        usb.init();
+        USB.reg.CNTR = (1 << 15) | (1 << 10); // CTRM, RESETM
+    }
+
+    usb_detached = false;
+    usb_pu.on();
+}
+
+// Drop off the bus long enough for the host to notice, then come back with
+// the new polling interval. Everything else keeps running in the meantime.
+void usb_reenumerate() {
+    usb_pu.off();
+    usb_detached = true;
+    usb_detach_timer.arm(100);
+}
+
+void usb_write(uint32_t ep, uint32_t* bufp, uint32_t len) {
+    usb_irq_lock lock;
+    usb.write(ep, bufp, len);
+}
+
+// Writes the report if the endpoint is free and no other report is waiting
+// for it, otherwise stages it for the USB interrupt to send once the endpoint
+// drains. A newer report replaces a staged one. USB interrupt locked out.
+void usb_send_locked(ep_stage& stage, const void* report, uint32_t len) {
+    if (usb.ep_ready(stage.ep) &&
+        !ep_stage_next(stage.ep, gamepad_stage, keyboard_stage)) {
+        usb_write_report(stage, report, len);
+        stage.written_directly += 1;
+    } else {
+        stage.put(report, len);
+        usb_flush_ep(stage.ep);
+    }
+}
+
+void usb_send(ep_stage& stage, const void* report, uint32_t len) {
+    if (usb_detached) {
+        return;
+    }
+
+    usb_irq_lock lock;
+    usb_send_locked(stage, report, len);
+}
+
+// Also tags the report for latency measurement, together with staging it so
+// that the tag goes with the right report.
+void usb_send_gamepad(uint16_t buttons, uint8_t axis_x, const void* report, uint32_t len) {
+    if (usb_detached) {
+        return;
+    }
+
+    usb_irq_lock lock;
+    latency.queued(buttons, axis_x);
+    usb_send_locked(gamepad_stage, report, len);
+}
 
 bool global_led_enable = false;
 bool global_tt_hid_enable = false;
@@ -151,7 +435,116 @@ void interrupt<Interrupt::DMA1_Channel7>() {
 
 timer hid_lights_expiry_timer;
 
-class HID_arcin : public USB_HID {
+// HID output reports are applied by the main loop, not during USB processing
+mailbox<uint16_t> hid_lights_mailbox;
+mailbox<ColorRgb> hid_rgb_mailbox;
+
+// Profile switches requested by the host
+mailbox<uint8_t> profile_mailbox;
+
+// Telemetry streaming on / off, from the host or a new configuration
+mailbox<bool> telemetry_mailbox;
+
+// USB_HID with SET_IDLE / GET_IDLE support. The main loop asks idle whether
+// a report needs to be written at all.
+class USB_HID_idle : public USB_HID {
+    private:
+        uint8_t interface_num;
+
+        // Served instead of the report descriptor given at construction
+        const desc_t* alt_report_desc = nullptr;
+
+        // Another report carried by this interface (single-interface mode),
+        // whose idle rate follows SET_IDLE here
+        hid_idle* shared_idle = nullptr;
+        uint8_t shared_report_id;
+
+        // Left out of the configuration descriptor: nothing to configure
+        bool present = true;
+
+    public:
+        hid_idle idle;
+
+        // Must be set before enumeration, together with a configuration
+        // descriptor that gives the matching report descriptor length.
+        void set_report_desc(const desc_t* rdesc) {
+            alt_report_desc = rdesc;
+        }
+
+        void set_shared_idle(hid_idle* other, uint8_t report_id) {
+            shared_idle = other;
+            shared_report_id = report_id;
+        }
+
+        void set_present(bool on) {
+            present = on;
+        }
+
+        USB_HID_idle(USB_generic& usbd, desc_t rdesc, uint8_t interface, uint8_t ep, uint8_t default_idle_rate) :
+            USB_HID(usbd, rdesc, interface, ep, 64),
+            interface_num(interface),
+            idle(default_idle_rate) {}
+
+    protected:
+        virtual SetupStatus handle_setup(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength) {
+            if (!present) {
+                return SetupStatus::Unhandled;
+            }
+
+            if (wIndex == interface_num) {
+                // The low byte of wValue is the report ID; 0 = all reports
+                uint8_t report_id = wValue & 0xff;
+                bool shared = shared_idle && report_id == shared_report_id;
+
+                // Set idle.
+                if (bmRequestType == 0x21 && bRequest == 0x0a) {
+                    if (!shared) {
+                        idle.set_idle_rate(wValue >> 8);
+                    }
+                    if (shared_idle && (shared || report_id == 0)) {
+                        shared_idle->set_idle_rate(wValue >> 8);
+                    }
+                    usb.write(0, nullptr, 0);
+                    return SetupStatus::Ok;
+                }
+
+                // Get idle.
+                if (bmRequestType == 0xa1 && bRequest == 0x02 && wLength >= 1) {
+                    uint32_t rate = shared ? shared_idle->get_idle_rate() : idle.get_idle_rate();
+                    usb.write(0, &rate, 1);
+                    return SetupStatus::Ok;
+                }
+
+                // Get report descriptor.
+                if (alt_report_desc && bmRequestType == 0x81 && bRequest == 0x06 && wValue == 0x2200) {
+                    uint32_t len = alt_report_desc->size;
+
+                    if (len > wLength) {
+                        len = wLength;
+                    }
+
+                    usb.write(0, (uint32_t*)alt_report_desc->data, len);
+                    return SetupStatus::Ok;
+                }
+            }
+
+            return USB_HID::handle_setup(bmRequestType, bRequest, wValue, wIndex, wLength);
+        }
+
+        virtual void handle_set_configuration(uint8_t configuration) {
+            idle.reset();
+
+            if (shared_idle) {
+                shared_idle->reset();
+            }
+
+            if (present) {
+                USB_HID::handle_set_configuration(configuration);
+            }
+        }
+};
+
+class HID_arcin : public USB_HID_idle {
     private:
         bool set_feature_bootloader(bootloader_report_t* report) {
             switch(report->func) {
@@ -176,23 +569,61 @@ class HID_arcin : public USB_HID {
                 return false;
             }
             
-            configloader.write(report->size, report->data);
-            
-            return true;
+            return config_transfer.write_legacy(report->size, report->data);
         }
         
         bool get_feature_config() {
-            config_report_t report = {0xc0, 0, sizeof(config)};
+            config_report_t report = {0xc0, 0, CONFIG_SEGMENT_SIZE};
             
-            memcpy(report.data, &config, sizeof(config));
+            memcpy(report.data, &config, CONFIG_SEGMENT_SIZE);
 
             usb.write(0, (uint32_t*)&report, sizeof(report));
             
             return true;
         }
+
+        bool set_feature_profile(profile_report_t* report) {
+            if (report->active >= CONFIG_PROFILE_COUNT) {
+                return false;
+            }
+
+            profile_mailbox.post(report->active);
+            return true;
+        }
+
+        bool get_feature_profile() {
+            profile_report_t report;
+
+            profiles.get_report(&report);
+
+            usb.write(0, (uint32_t*)&report, sizeof(report));
+
+            return true;
+        }
+
+        bool get_feature_config_status() {
+            config_status_report_t report;
+
+            config_transfer.get_status_report(&report);
+
+            usb.write(0, (uint32_t*)&report, sizeof(report));
+
+            return true;
+        }
+
+        bool get_feature_config_segment() {
+            config_segment_report_t report;
+
+            config_transfer.read_segment_report(&report);
+
+            usb.write(0, (uint32_t*)&report, sizeof(report));
+
+            return true;
+        }
     
     public:
-        HID_arcin(USB_generic& usbd, desc_t rdesc) : USB_HID(usbd, rdesc, 0, 1, 64) {}
+        // Gamepads default to an infinite idle period (send on change only)
+        HID_arcin(USB_generic& usbd, desc_t rdesc) : USB_HID_idle(usbd, rdesc, 0, 1, 0) {}
     
     protected:
         virtual bool set_output_report(uint32_t* buf, uint32_t len) {
@@ -203,14 +634,14 @@ class HID_arcin : public USB_HID {
             uint8_t report_id = *(uint8_t*)buf;
             if (report_id == 0x2 && len == sizeof(output_report_t)) {
                 output_report_t* report = (output_report_t*)buf;
-                set_hid_lights(report->leds);
+                hid_lights_mailbox.post(report->leds);
 
             } else if (report_id == 0x3 &&
                        len == sizeof(output_report_rgb_t) &&
                        config.flags.Ws2812b) {
 
                 output_report_rgb_t* report = (output_report_rgb_t*)buf;
-                rgb_manager.update_from_hid(report->rgb);
+                hid_rgb_mailbox.post(report->rgb);
             }
 
             return true;
@@ -231,6 +662,20 @@ class HID_arcin : public USB_HID {
                     }
                     
                     return set_feature_config((config_report_t*)buf);
+
+                case 0xc1:
+                    if(len != sizeof(config_segment_report_t)) {
+                        return false;
+                    }
+
+                    return config_transfer.write_segment((config_segment_report_t*)buf);
+
+                case PROFILE_REPORT_ID:
+                    if(len != sizeof(profile_report_t)) {
+                        return false;
+                    }
+
+                    return set_feature_profile((profile_report_t*)buf);
                 
                 default:
                     return false;
@@ -241,6 +686,15 @@ class HID_arcin : public USB_HID {
             switch(report_id) {
                 case 0xc0:
                     return get_feature_config();
+
+                case 0xc1:
+                    return get_feature_config_segment();
+
+                case CONFIG_STATUS_REPORT_ID:
+                    return get_feature_config_status();
+
+                case PROFILE_REPORT_ID:
+                    return get_feature_profile();
                 
                 default:
                     return false;
@@ -248,9 +702,10 @@ class HID_arcin : public USB_HID {
         }
 };
 
-class HID_keyb : public USB_HID {
+class HID_keyb : public USB_HID_idle {
     public:
-        HID_keyb(USB_generic& usbd, desc_t rdesc) : USB_HID(usbd, rdesc, 1, 2, 64) {}
+        // Keyboards default to 500ms as recommended by the HID spec
+        HID_keyb(USB_generic& usbd, desc_t rdesc) : USB_HID_idle(usbd, rdesc, 1, 2, 125) {}
 
     protected:
         virtual bool set_output_report(uint32_t* buf, uint32_t len) {
@@ -264,14 +719,146 @@ class HID_keyb : public USB_HID {
         }
 };
 
-HID_arcin usb_hid_1000hz(usb_1000hz, report_desc_p);
-HID_arcin usb_hid_250hz(usb_250hz, report_desc_p);
+class HID_telemetry : public USB_HID {
+    private:
+        // Left out of the configuration descriptor in single-interface mode
+        bool present = true;
+
+        bool get_feature_enable() {
+            telemetry_enable_report_t report = {
+                TELEMETRY_ENABLE_REPORT_ID, telemetry.enabled};
+
+            usb.write(0, (uint32_t*)&report, sizeof(report));
+
+            return true;
+        }
+
+    public:
+        HID_telemetry(USB_generic& usbd, desc_t rdesc) : USB_HID(usbd, rdesc, 2, 3, 64) {}
+
+        void set_present(bool on) {
+            present = on;
+        }
+
+        bool is_present() {
+            return present;
+        }
+
+    protected:
+        virtual SetupStatus handle_setup(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength) {
+            if (!present) {
+                return SetupStatus::Unhandled;
+            }
+
+            return USB_HID::handle_setup(bmRequestType, bRequest, wValue, wIndex, wLength);
+        }
+
+        virtual bool set_output_report(uint32_t* buf, uint32_t len) {
+            if ((*buf & 0xff) == ECHO_REPORT_ID && len == sizeof(echo_request_t)) {
+                // Answered from the USB interrupt once the endpoint is free
+                echo_request_t* report = (echo_request_t*)buf;
+                latency_echo.received(report->token);
+            }
+
+            return true;
+        }
+
+        virtual bool set_feature_report(uint32_t* buf, uint32_t len) {
+            if ((*buf & 0xff) != TELEMETRY_ENABLE_REPORT_ID ||
+                len != sizeof(telemetry_enable_report_t)) {
+                return false;
+            }
+
+            telemetry_mailbox.post(((telemetry_enable_report_t*)buf)->enable != 0);
+            return true;
+        }
+
+        virtual bool get_feature_report(uint8_t report_id) {
+            switch(report_id) {
+                case TELEMETRY_ENABLE_REPORT_ID:
+                    return get_feature_enable();
+
+                default:
+                    return false;
+            }
+        }
+
+        virtual void handle_set_configuration(uint8_t configuration) {
+            if (present) {
+                USB_HID::handle_set_configuration(configuration);
+            }
+
+            // Streaming is off until the host asks for it
+            telemetry_mailbox.post(false);
+        }
+};
+
+HID_arcin usb_hid(usb, report_desc_p);
+HID_keyb usb_hid_keyb(usb, keyb_report_desc_p);
+HID_telemetry usb_hid_telemetry(usb, telemetry_report_desc_p);
+USB_strings usb_strings(usb, config.label);
 
-HID_keyb usb_hid_keyb_1000hz(usb_1000hz, keyb_report_desc_p);
-HID_keyb usb_hid_keyb_250hz(usb_250hz, keyb_report_desc_p);
+// Serves the configuration descriptor with the length of the selected layout.
+// The stack got its copy of conf_desc_p at construction, and hosts may ask for
+// more than wTotalLength (Windows asks for 255 bytes).
+class USB_conf_desc : public USB_class_driver {
+    private:
+        USB_generic& usb;
 
-USB_strings usb_strings_1000hz(usb_1000hz, config.label);
-USB_strings usb_strings_250hz(usb_250hz, config.label);
+    public:
+        USB_conf_desc(USB_generic& usbd) : usb(usbd) {
+            usb.register_driver(this);
+        }
+
+    protected:
+        virtual SetupStatus handle_setup(uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint16_t wLength) {
+            // Get configuration descriptor.
+            if (bmRequestType == 0x80 && bRequest == 0x06 && wValue == 0x0200) {
+                uint32_t len = conf_desc_p.size;
+
+                if (len > wLength) {
+                    len = wLength;
+                }
+
+                usb.write(0, (uint32_t*)conf_desc_p.data, len);
+                return SetupStatus::Ok;
+            }
+
+            return SetupStatus::Unhandled;
+        }
+};
+
+USB_conf_desc usb_conf_desc(usb);
+
+// Interface layout and keyboard report, from the live config. Takes effect on
+// the next (re-)enumeration.
+void usb_select_layout() {
+    usb_combined = config.flags.SingleInterface;
+    keyboard_nkro = !usb_combined && config.flags.KeyboardNkro;
+
+    // In single-interface mode the keyboard and telemetry interfaces are left
+    // out, and their endpoints aren't configured. The keyboard report goes
+    // out on the gamepad endpoint, with the idle rate of interface 0.
+    usb_hid.set_report_desc(usb_combined ? &combined_report_desc_p : nullptr);
+    usb_hid.set_shared_idle(
+        usb_combined ? &usb_hid_keyb.idle : nullptr, KEYB_COMBINED_REPORT_ID);
+    usb_hid_keyb.set_present(!usb_combined);
+    usb_hid_telemetry.set_present(!usb_combined);
+    keyboard_stage.ep = usb_combined ? 1 : 2;
+
+    conf_desc_p.size =
+        usb_combined ? sizeof(conf_desc.combined) : sizeof(conf_desc.split);
+
+    usb_hid_keyb.set_report_desc(keyboard_nkro ? &keyb_nkro_report_desc_p : nullptr);
+    keyb_report_desc_size =
+        keyboard_nkro ? sizeof(keyb_nkro_report_desc) : sizeof(keyb_report_desc);
+}
+
+bool usb_layout_changed() {
+    return
+        (usb_combined != config.flags.SingleInterface) ||
+        (keyboard_nkro != (!config.flags.SingleInterface && config.flags.KeyboardNkro));
+}
 
 debounce_state debounce_state_raw;
 debounce_state debounce_state_keys;
@@ -349,6 +936,144 @@ uint32_t debug_value;
 
 #endif
 
+config_flags runtime_flags;
+tt_accel tt1_accel;
+bool rgb_initialized = false;
+
+// What the main loop does each iteration, decoded from the above
+runtime_plan_t plan;
+
+void rebuild_plan() {
+    build_runtime_plan(
+        plan,
+        config,
+        runtime_flags,
+        analog_tt_reverse_direction,
+        ARRAY_SIZE(infinitas_keys));
+}
+
+// True if the field differs between previous and the live config (or there
+// is no previous config)
+#define CONFIG_CHANGED(previous, field) \
+    (!(previous) || \
+     memcmp(&(previous)->field, &config.field, sizeof(config.field)) != 0)
+
+// Everything derived from the live config that can change without
+// re-enumerating. Only the stages whose inputs differ from previous are
+// re-initialised; with no previous config, all of them are. Runs at the end
+// of init, after a profile switch and for previews, so it must not block.
+void apply_config(const config_t* previous) {
+    bool flags_changed = CONFIG_CHANGED(previous, flags);
+
+    // This also drops any runtime mode switches
+    if (flags_changed) {
+        runtime_flags = initialize_mode_switch(config.flags);
+
+        global_led_enable = !runtime_flags.LedOff;
+        global_tt_hid_enable = runtime_flags.TtLedHid;
+
+        TIM2.CCER = runtime_flags.InvertQE1 ? 0 : (1 << 1);
+    }
+
+    bool qe1_range_changed = false;
+    uint32_t qe1_arr = (config.qe1_sens < 0) ? (256 * -config.qe1_sens - 1) : (256 - 1);
+    if (TIM2.ARR != qe1_arr) {
+        TIM2.ARR = qe1_arr;
+        TIM2.CNT = 0;
+        qe1_range_changed = true;
+    }
+
+    uint32_t qe2_arr = (config.qe2_sens < 0) ? (256 * -config.qe2_sens - 1) : (256 - 1);
+    if (TIM3.ARR != qe2_arr) {
+        TIM3.ARR = qe2_arr;
+        TIM3.CNT = 0;
+    }
+
+    if (config.flags.TtAccelEnable &&
+        (flags_changed || qe1_range_changed || CONFIG_CHANGED(previous, tt_accel_curve))) {
+        tt1_accel.init(config.tt_accel_curve, TIM2.ARR + 1);
+    }
+
+    if (flags_changed || CONFIG_CHANGED(previous, debounce_ticks)) {
+        if (runtime_flags.DebounceEnable) {
+            debounce_init(&debounce_state_keys, config.debounce_ticks);
+        }
+
+        // effectors always have a little bit of debouncing enabled
+        debounce_window_effectors = 4;
+
+        // Take the higher value if user has debouncing enabled
+        if (runtime_flags.DebounceEnable) {
+            debounce_window_effectors =
+                max(debounce_window_effectors, config.debounce_ticks);
+        }
+
+        debounce_init(&debounce_state_effectors, debounce_window_effectors);
+    }
+
+    // Used once the keyboard is (re-)enumerated in NKRO mode
+    if (CONFIG_CHANGED(previous, keycodes)) {
+        nkro_init(config, infinitas_keys, ARRAY_SIZE(infinitas_keys));
+    }
+
+    if (config.flags.Ws2812b) {
+        if (!rgb_initialized) {
+            // turn on the power before initializing
+            button9_led.on();
+            rgb_manager.init(&config.rgb);
+            rgb_initialized = true;
+        } else if (CONFIG_CHANGED(previous, rgb)) {
+            rgb_manager.configure(&config.rgb);
+        }
+    } else if (rgb_initialized) {
+        // Switched off (by a preview or another profile): blank the strip
+        // instead of leaving it on its last frame
+        rgb_manager.shutdown();
+        rgb_initialized = false;
+    }
+
+    rebuild_plan();
+
+    // Interface layout changes need the host to enumerate the device again
+    if (previous && usb_layout_changed()) {
+        usb_reenumerate();
+    }
+}
+
+// Makes another profile live
+void switch_profile(uint8_t index) {
+    config_t previous = config;
+
+    {
+        usb_irq_lock lock;
+        if (!profiles.select(index)) {
+            return;
+        }
+    }
+
+    apply_config(&previous);
+
+    // Show which profile is active: button 1, 3, 5 or 7
+    uint16_t mode_lights =
+        (ARCIN_PIN_BUTTON_START | ARCIN_PIN_BUTTON_SELECT | ARCIN_PIN_BUTTON_2);
+    schedule_led(
+        2500,
+        mode_lights | (ARCIN_PIN_BUTTON_1 << (2 * index)),
+        mode_lights);
+}
+
+// Makes a config from the host live without saving it
+void preview_config(const config_t& preview) {
+    config_t previous = config;
+
+    {
+        usb_irq_lock lock;
+        config = preview;
+    }
+
+    apply_config(&previous);
+}
+
 int main() {
     rcc_init();
     
@@ -357,9 +1082,10 @@ int main() {
     STK.CTRL = 0x03;
     
     // Load config.
-    configloader.read(sizeof(config), &config);
+    crc32_init();
+    profiles.load();
 
-    config_flags runtime_flags = initialize_mode_switch(config.flags);
+    runtime_flags = initialize_mode_switch(config.flags);
 
     RCC.enable(RCC.GPIOA);
     RCC.enable(RCC.GPIOB);
@@ -372,17 +1098,16 @@ int main() {
     
     RCC.enable(RCC.USB);
     
-    USB_f1* usb;
-    if (runtime_flags.PollAt250Hz) {
-        usb = &usb_250hz;
-    } else {
-        usb = &usb_1000hz;
-    }
-
-    usb->init();
-    
     usb_pu.set_mode(Pin::Output);
-    usb_pu.on();
+
+    // Interrupt priorities, highest first: SysTick (time keeping), WS2812B
+    // DMA (strict bit timing), USB. USB runs below everything else so it
+    // never delays them, and everything it triggers that is slow (lights,
+    // RGB) is deferred to the main loop through mailboxes.
+    Interrupt::set_priority(Interrupt::DMA1_Channel7, 0x40);
+    Interrupt::set_priority(Interrupt::USB_LP_CAN_RX0, 0xc0);
+
+    usb_attach(poll_interval_request);
     
     button_inputs.set_mode(Pin::Input);
     button_inputs.set_pull(Pin::PullUp);
@@ -397,36 +1122,17 @@ int main() {
     led2.set_mode(Pin::Output);
     set_tt_led(false, false);
     
-    global_led_enable = !runtime_flags.LedOff;
-    global_tt_hid_enable = runtime_flags.TtLedHid;
-    
     RCC.enable(RCC.TIM2);
     RCC.enable(RCC.TIM3);
     
-    if(!(runtime_flags.InvertQE1)) {
-        TIM2.CCER = 1 << 1;
-    }
-    
     TIM2.CCMR1 = (1 << 8) | (1 << 0);
     TIM2.SMCR = 3;
     TIM2.CR1 = 1;
     
-    if(config.qe1_sens < 0) {
-        TIM2.ARR = 256 * -config.qe1_sens - 1;
-    } else {
-        TIM2.ARR = 256 - 1;
-    }
-    
     TIM3.CCMR1 = (1 << 8) | (1 << 0);
     TIM3.SMCR = 3;
     TIM3.CR1 = 1;
     
-    if(config.qe2_sens < 0) {
-        TIM3.ARR = 256 * -config.qe2_sens - 1;
-    } else {
-        TIM3.ARR = 256 - 1;
-    }
-    
     qe1a.set_af(1);
     qe1b.set_af(1);
     qe1a.set_mode(Pin::AF);
@@ -439,20 +1145,10 @@ int main() {
 
     analog_button tt1(4, 200, true);
 
-    if (runtime_flags.DebounceEnable) {
-        debounce_init(&debounce_state_keys, config.debounce_ticks);
-    }
-
-    // effectors always have a little bit of debouncing enabled
-    debounce_window_effectors = 4;
-
-    // Take the higher value if user has debouncing enabled
-    if (runtime_flags.DebounceEnable) {
-        debounce_window_effectors =
-            max(debounce_window_effectors, config.debounce_ticks);
-    }
-
-    debounce_init(&debounce_state_effectors, debounce_window_effectors);
+    // [SPARE PAGE] state
+    uint32_t idle_since = 0;
+    uint32_t idle_qe1 = TIM2.CNT;
+    bool spare_checked = false;
 
     // debounce for raw input
     debounce_init(&debounce_state_raw, 4);
@@ -460,21 +1156,53 @@ int main() {
     // Init done, flash some lights for 1 second
     schedule_led(1000, ARCIN_PIN_BUTTON_WHITE, ARCIN_PIN_BUTTON_WHITE);
 
-    if (config.flags.Ws2812b) {
-        // turn on the power before initializing
-        button9_led.on();
-        // must be called last
-        rgb_manager.init(&config.rgb);
-    }
+    // must be called last (initializes WS2812B)
+    apply_config(nullptr);
 
     while(1) {
-        usb->process();
+        // [TELEMETRY ENABLE] Latency tagging rides along with telemetry
+        // streaming. The interrupt uses the tracker too.
+        {
+            usb_irq_lock lock;
 
-        uint16_t buttons = button_inputs.get() ^ 0x7ff;
-        if (config.flags.Ws2812b) {
-            buttons &= (~ARCIN_PIN_BUTTON_9);
+            bool enable;
+            if (telemetry_mailbox.take(enable)) {
+                telemetry.enable(enable);
+                latency.enable(enable);
+            }
+        }
+
+        telemetry.loop();
+
+        // [SLOT CONFIRM] Keep the trial watchdog fed, and confirm the slot
+        iwdg_refresh();
+
+        if (!slot_confirmed && Time::time() >= SLOT_CONFIRM_MS &&
+            (!configloader.busy() || configloader.waiting())) {
+            confirm_slot();
+        }
+
+        // [CONFIG SAVE] One flash step at a time, never waits on the flash
+        // (but see [SPARE PAGE])
+        {
+            usb_irq_lock lock;
+            profiles.poll();
         }
+        configloader.poll();
+
+        latency.sampled();
+
+        uint16_t buttons = (button_inputs.get() ^ 0x7ff) & plan.button_mask;
         
+        // Let a pending save finish first. A stall doesn't matter any more,
+        // so one waiting for its erase gets it now.
+        if((do_reset_bootloader || do_reset) && profiles.saving()) {
+            if (configloader.waiting()) {
+                configloader.erase_spare();
+            }
+            continue;
+        }
+
         if(do_reset_bootloader) {
             Time::sleep(10);
             reset_bootloader();
@@ -484,7 +1212,64 @@ int main() {
             Time::sleep(10);
             reset();
         }
+
+        // [USB POLLING RATE] Re-enumerate when the player picks a new rate
+        if (usb_detached) {
+            if (usb_detach_timer.check_if_expired_reset()) {
+                usb_attach(poll_interval_request);
+            }
+        } else if (poll_interval_request != usb_poll_interval) {
+            usb_reenumerate();
+        }
         
+        // [CONFIG PREVIEW] Live-apply a config from the host
+        {
+            config_t preview;
+            bool taken;
+            {
+                usb_irq_lock lock;
+                taken = config_transfer.previews.take(preview);
+            }
+
+            if (taken) {
+                preview_config(preview);
+            }
+        }
+
+        // [PROFILE] Switch when the host or the button combo asks for it
+        {
+            uint8_t index;
+            bool taken;
+            {
+                usb_irq_lock lock;
+                taken = profile_mailbox.take(index);
+            }
+
+            if (!taken && profile_cycle_request) {
+                index = (profiles.active() + 1) % CONFIG_PROFILE_COUNT;
+                taken = true;
+            }
+            profile_cycle_request = false;
+
+            if (taken) {
+                switch_profile(index);
+            }
+        }
+
+        // [HID LIGHTS] Apply the latest lights report, if any
+        {
+            uint16_t leds;
+            bool taken;
+            {
+                usb_irq_lock lock;
+                taken = hid_lights_mailbox.take(leds);
+            }
+
+            if (taken) {
+                set_hid_lights(leds);
+            }
+        }
+
         // Non-HID controlled handling of button LEDs
         if (scheduled_led_timer.is_armed()) {
             int32_t diff = scheduled_led_timer.get_remaining_time();
@@ -509,7 +1294,7 @@ int main() {
                 set_button_lights(0);
             }
 
-            if (!runtime_flags.TtLedReactive) {
+            if (!plan.tt_led_reactive) {
                 // revert back to static on or off state, depending on user selection
                 set_tt_led(global_led_enable, global_led_enable);
             }
@@ -517,9 +1302,27 @@ int main() {
 
         // [READ QE1]
         uint32_t qe1_count = TIM2.CNT;
+        telemetry.tt_count(qe1_count);
+
+        // [SPARE PAGE] A page erase stalls the CPU, and with it input
+        // sampling and USB, for 20-40 ms. Do the one a save waits for, or
+        // the next save would need, once nothing has been touched for a
+        // while, not mid-game.
+        if (profiles.saving()) {
+            spare_checked = false;
+        }
+
+        if (buttons != 0 || qe1_count != idle_qe1) {
+            idle_since = Time::time();
+            idle_qe1 = qe1_count;
+        } else if ((configloader.waiting() || (!spare_checked && !profiles.saving())) &&
+                   Time::time() - idle_since >= SPARE_ERASE_IDLE_MS) {
+            configloader.erase_spare();
+            spare_checked = true;
+        }
 
         // [MODE] Apply debounce to raw input & process runtime mode switching
-        if (runtime_flags.ModeSwitchEnable) {
+        if (plan.mode_switch) {
             uint16_t raw_debounced = buttons;
             uint16_t debounce_mask =
                 (INFINITAS_BUTTON_ALL | INFINITAS_EFFECTORS_ALL);
@@ -527,17 +1330,25 @@ int main() {
                 (buttons & ~debounce_mask) |
                 (debounce(&debounce_state_raw, buttons & debounce_mask));
 
+            config_flags previous_flags = runtime_flags;
+            bool previous_reverse = analog_tt_reverse_direction;
+
             runtime_flags = process_mode_switch(raw_debounced);
 
             // Update LED options state.
             global_led_enable = !runtime_flags.LedOff;
+
+            if (runtime_flags.AsUINT32 != previous_flags.AsUINT32 ||
+                analog_tt_reverse_direction != previous_reverse) {
+                rebuild_plan();
+            }
         }
 
         // [REMAP]
         uint16_t remapped = remap_buttons(config, buttons);
 
         // [DEBOUNCE] Apply debounce to remapped keys
-        if (runtime_flags.DebounceEnable) {
+        if (plan.debounce_keys) {
             uint16_t debounce_mask = INFINITAS_BUTTON_ALL;
             remapped =
                 (remapped & ~debounce_mask) |
@@ -552,12 +1363,20 @@ int main() {
                 (debounce(&debounce_state_effectors, remapped & debounce_mask));
         }
 
+        telemetry.debounced(remapped);
+
         // [DIGITAL QE1]
         int8_t tt1_report = 0;
         tt1_report = tt1.poll(qe1_count);
 
+        // [ANALOG QE1 ACCELERATION]
+        // Must be done after digital TT, which works off the raw count.
+        if (plan.tt_accel) {
+            qe1_count = tt1_accel.poll(qe1_count);
+        }
+
         // [DIGITAL QE1 POST-PROCESSING]
-        if (runtime_flags.TtLedReactive) {
+        if (plan.tt_led_reactive) {
             if (global_led_enable) {
                 switch (tt1_report) {
                     case -1:
@@ -573,13 +1392,28 @@ int main() {
             }
         }
 
-        if (config.flags.Ws2812b) {
+        if (plan.ws2812b) {
+            uint32_t rgb_start = telemetry.start();
+
+            // Only the latest HID color is rendered, once per frame
+            ColorRgb hid_rgb;
+            bool taken = false;
+            if (rgb_manager.is_frame_due()) {
+                usb_irq_lock lock;
+                taken = hid_rgb_mailbox.take(hid_rgb);
+            }
+
+            if (taken) {
+                rgb_manager.update_from_hid(hid_rgb);
+            }
+
             rgb_manager.update_colors(-tt1_report);
+            telemetry.rgb_frame(rgb_start);
         }
 
         // [E2 MULTI-TAP]
         // Multi-tap processing of E2. Must be done after debounce.
-        if (runtime_flags.SelectMultiFunction) {
+        if (plan.multi_function) {
             // Always clear E2 since it should not be asserted directly
             bool is_e2_pressed = (remapped & INFINITAS_BUTTON_E2) != 0;
             remapped &= ~(INFINITAS_BUTTON_E2);
@@ -587,51 +1421,19 @@ int main() {
         }
 
         // [GAMEPAD]]
-        if (usb->ep_ready(1)) {
+        // Built every iteration; if the endpoint is busy the report is staged
+        // and the USB interrupt sends it as soon as the endpoint frees up.
+        // In single-interface mode only the active device sends reports.
+        if (!usb_detached && (plan.gamepad_enabled || !usb_combined)) {
             input_report_t report;
             report.report_id = 1;
 
-            // [Joy Buttons report]
-            if (runtime_flags.JoyInputForceDisable) {
-                report.buttons = 0;
-            } else {
-                // [DIGITAL TT -> BUTTONS]
-                if (runtime_flags.DigitalTTEnable) {
-                    switch (tt1_report) {
-                    case -1:
-                        remapped |= JOY_BUTTON_13;
-                        break;
-                    case 1:
-                        remapped |= JOY_BUTTON_14;
-                        break;
-                    default:
-                        break;
-                    }
-                }
-
-                report.buttons = remapped;
-            }
-
-            // [X-axis report]
-            if (runtime_flags.JoyInputForceDisable ||
-                (runtime_flags.DigitalTTEnable && !runtime_flags.AnalogTTForceEnable)) {
-                report.axis_x = uint8_t(127);
-            } else {
-                // [ANALOG TT -> SENSITIVITY]
-                // Adjust turntable sensitivity. Must be done AFTER digital TT
-                // processing.
-                if (config.qe1_sens < 0) {
-                    qe1_count /= -config.qe1_sens;
-                } else if (config.qe1_sens > 0) {
-                    qe1_count *= config.qe1_sens;
-                }
+            // [Joy Buttons report] + [DIGITAL TT -> BUTTONS]
+            report.buttons = plan_gamepad_buttons(plan, remapped, tt1_report);
 
-                if (analog_tt_reverse_direction) {
-                    report.axis_x = uint8_t(255 - qe1_count);
-                } else {
-                    report.axis_x = uint8_t(qe1_count);
-                }
-            }
+            // [X-axis report] + [ANALOG TT -> SENSITIVITY]
+            // Must be done AFTER digital TT processing.
+            report.axis_x = plan_axis_x(plan, qe1_count);
 
             report.axis_y = 127;
 
@@ -649,40 +1451,69 @@ int main() {
 
 #endif
 
-            usb->write(1, (uint32_t*)&report, sizeof(report));
+            // Only send when something changed or the idle period expired.
+            if (usb_hid.idle.should_send(&report, sizeof(report))) {
+                uint32_t write_start = telemetry.start();
+                usb_send_gamepad(report.buttons, report.axis_x, &report, sizeof(report));
+                telemetry.gamepad_written(write_start);
+            }
         }
         
+        // [KEYBOARD NKRO]
+        if (keyboard_nkro && !usb_detached) {
+            keyb_nkro_report_t report;
+            uint16_t inputs = plan_keyboard_inputs(plan, remapped, tt1_report);
+
+            nkro_build_report(inputs, &report);
+
+            if (usb_hid_keyb.idle.should_send(&report, sizeof(report))) {
+                uint32_t write_start = telemetry.start();
+                usb_send(keyboard_stage, &report, sizeof(report));
+                telemetry.keyboard_written(write_start);
+            }
+        }
+
         // [KEYBOARD]]
-        if (usb->ep_ready(2)) {
-            unsigned char scancodes[13] = { 0 };
+        if (!keyboard_nkro && !usb_detached &&
+            (plan.keyboard_enabled || !usb_combined)) {
+            // The report ID is only sent in single-interface mode
+            keyb_combined_report_t report = { KEYB_COMBINED_REPORT_ID, { 0 } };
 
             static_assert(
                 ARRAY_SIZE(infinitas_keys) + 1 <=
-                ARRAY_SIZE(scancodes),
+                ARRAY_SIZE(report.scancodes),
                 "keycode array too small");
 
-            uint8_t nextscan = 0;
+            plan_scancodes(
+                plan, infinitas_keys, config.keycodes, remapped, tt1_report,
+                report.scancodes);
 
-            if (runtime_flags.KeyboardEnable) {
-                for (uint8_t i = 0; i < ARRAY_SIZE(infinitas_keys); i++) {
-                    if (remapped & infinitas_keys[i]) {
-                        scancodes[nextscan++] = config.keycodes[i];
-                    }
-                }
+            const void* buf = &report;
+            uint32_t len = sizeof(report);
+            if (!usb_combined) {
+                buf = report.scancodes;
+                len = sizeof(report.scancodes);
+            }
 
-                switch (tt1_report) {
-                case -1:
-                    scancodes[nextscan++] = config.keycodes[11];
-                    break;
-                case 1:
-                    scancodes[nextscan++] = config.keycodes[12];
-                    break;
-                default:
-                    break;
-                }
+            if (usb_hid_keyb.idle.should_send(buf, len)) {
+                uint32_t write_start = telemetry.start();
+                usb_send(keyboard_stage, buf, len);
+                telemetry.keyboard_written(write_start);
             }
+        }
 
-            usb->write(2, (uint32_t*)scancodes, sizeof(scancodes));
+        // [TELEMETRY] Checked and written in one go, as the USB interrupt
+        // writes latency echoes to the same endpoint
+        if (telemetry.enabled && usb_hid_telemetry.is_present() && !usb_detached) {
+            usb_irq_lock lock;
+
+            telemetry_report_t* report = usb.ep_ready(3) ? telemetry.get_pending() : nullptr;
+            if (report) {
+                report->latency_count =
+                    latency.take(report->latency, TELEMETRY_LATENCY_EVENTS);
+
+                usb.write(3, (uint32_t*)report, sizeof(*report));
+            }
         }
     }
 }
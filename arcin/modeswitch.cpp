@@ -7,19 +7,27 @@
 void process_input_mode_switch();
 void process_tt_mode_switch();
 void process_led_mode_switch();
+void process_poll_mode_switch();
 
 uint32_t last_capture_time = 0;
 
 uint16_t input_mode_switch_request = 0;
 uint16_t tt_mode_switch_request = 0;
 uint16_t led_mode_switch_request = 0;
+uint16_t poll_mode_switch_request = 0;
+uint16_t profile_mode_switch_request = 0;
 
 config_flags original_flags = {0};
 config_flags current_flags = {0};
 
 bool analog_tt_reverse_direction = false;
 
+uint8_t poll_interval_request = 1;
+
+bool profile_cycle_request = false;
+
 config_flags initialize_mode_switch(config_flags flags) {
+    poll_interval_request = flags.PollAt250Hz ? 4 : 1;
     original_flags = flags;
     current_flags = original_flags;
     return original_flags;
@@ -45,12 +53,20 @@ config_flags process_mode_switch(uint16_t raw_input) {
         } else if (raw_input & ARCIN_PIN_BUTTON_5) {
             // start+sel+5 => LED switch (on or off)
             led_mode_switch_request += 1;
+        } else if (raw_input & ARCIN_PIN_BUTTON_7) {
+            // start+sel+7 => USB polling rate (1000 / 500 / 250 / 125 Hz)
+            poll_mode_switch_request += 1;
+        } else if (raw_input & ARCIN_PIN_BUTTON_2) {
+            // start+sel+2 => next config profile
+            profile_mode_switch_request += 1;
         }
 
     } else {
         input_mode_switch_request = 0;
         tt_mode_switch_request = 0;
         led_mode_switch_request = 0;
+        poll_mode_switch_request = 0;
+        profile_mode_switch_request = 0;
     }
 
     if (input_mode_switch_request == MODE_SWITCH_THRESHOLD_MS) {
@@ -67,6 +83,17 @@ config_flags process_mode_switch(uint16_t raw_input) {
         process_led_mode_switch();
         led_mode_switch_request = 0;
     }
+
+    if (poll_mode_switch_request == MODE_SWITCH_THRESHOLD_MS) {
+        process_poll_mode_switch();
+        poll_mode_switch_request = 0;
+    }
+
+    // Applied by main, which owns the profiles
+    if (profile_mode_switch_request == MODE_SWITCH_THRESHOLD_MS) {
+        profile_cycle_request = true;
+        profile_mode_switch_request = 0;
+    }
     
     return current_flags;
 }
@@ -163,5 +190,42 @@ void process_led_mode_switch() {
         (mode_lights | ARCIN_PIN_BUTTON_4),
         mode_lights);
 
+    return;
+}
+
+void process_poll_mode_switch() {
+    uint16_t mode_lights =
+        (ARCIN_PIN_BUTTON_START | ARCIN_PIN_BUTTON_SELECT | ARCIN_PIN_BUTTON_7);
+
+    // 1ms => 2ms => 4ms => 8ms => 1ms
+    uint16_t indicator;
+    switch (poll_interval_request) {
+        case 1:
+            poll_interval_request = 2;
+            indicator = ARCIN_PIN_BUTTON_4;
+            break;
+
+        case 2:
+            poll_interval_request = 4;
+            indicator = ARCIN_PIN_BUTTON_6;
+            break;
+
+        case 4:
+            poll_interval_request = 8;
+            indicator = (ARCIN_PIN_BUTTON_4 | ARCIN_PIN_BUTTON_6);
+            break;
+
+        case 8:
+        default:
+            poll_interval_request = 1;
+            indicator = ARCIN_PIN_BUTTON_2;
+            break;
+    }
+
+    schedule_led(
+        2500,
+        (mode_lights | indicator),
+        mode_lights);
+
     return;
 }
\ No newline at end of file
@@ -10,4 +10,10 @@ config_flags process_mode_switch(uint16_t raw_input);
 
 extern bool analog_tt_reverse_direction;
 
+// USB polling interval (ms) the player asked for; applied by re-enumerating
+extern uint8_t poll_interval_request;
+
+// Set when the player asks for the next config profile; cleared by main
+extern bool profile_cycle_request;
+
 #endif
\ No newline at end of file
@@ -0,0 +1,58 @@
+#include <string.h>
+#include "nkro.h"
+#include "inf_defines.h"
+
+typedef struct _nkro_key {
+    // offset into keyb_nkro_report_t
+    uint8_t index;
+    uint8_t mask;
+} nkro_key;
+
+// Indexed by input bit position
+static nkro_key nkro_keys[16];
+
+static nkro_key get_nkro_key(uint8_t keycode) {
+    nkro_key key = {0, 0};
+
+    if (NKRO_MODIFIER_USAGE_MIN <= keycode && keycode <= NKRO_MODIFIER_USAGE_MAX) {
+        key.index = 0;
+        key.mask = 1 << (keycode - NKRO_MODIFIER_USAGE_MIN);
+
+    } else if (0 < keycode && keycode <= NKRO_BITMAP_USAGE_MAX) {
+        key.index = 1 + (keycode / 8);
+        key.mask = 1 << (keycode % 8);
+    }
+
+    return key;
+}
+
+static void set_nkro_key(uint16_t input, uint8_t keycode) {
+    if (input == 0) {
+        return;
+    }
+
+    nkro_keys[__builtin_ctz(input)] = get_nkro_key(keycode);
+}
+
+void nkro_init(const config_t& config, const uint16_t* keys, uint8_t num_keys) {
+    memset(nkro_keys, 0, sizeof(nkro_keys));
+
+    for (uint8_t i = 0; i < num_keys; i++) {
+        set_nkro_key(keys[i], config.keycodes[i]);
+    }
+
+    // [11] = digital tt CW, [12] = digital tt CCW
+    set_nkro_key(JOY_BUTTON_13, config.keycodes[11]);
+    set_nkro_key(JOY_BUTTON_14, config.keycodes[12]);
+}
+
+void nkro_build_report(uint16_t inputs, keyb_nkro_report_t* report) {
+    uint8_t* buf = (uint8_t*)report;
+    memset(buf, 0, sizeof(*report));
+
+    while (inputs) {
+        uint8_t bit = __builtin_ctz(inputs);
+        buf[nkro_keys[bit].index] |= nkro_keys[bit].mask;
+        inputs &= inputs - 1;
+    }
+}
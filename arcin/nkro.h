@@ -0,0 +1,30 @@
+#ifndef NKRO_DEFINES_H
+#define NKRO_DEFINES_H
+
+#include <stdint.h>
+#include "config.h"
+
+// Usages 0x00-0x77 are reported in the bitmap; modifiers (0xe0-0xe7) get their
+// own byte. Anything else cannot be reported in NKRO mode.
+#define NKRO_BITMAP_LEN         15
+#define NKRO_BITMAP_USAGE_MAX   ((NKRO_BITMAP_LEN * 8) - 1)
+
+#define NKRO_MODIFIER_USAGE_MIN 0xe0
+#define NKRO_MODIFIER_USAGE_MAX 0xe7
+
+struct keyb_nkro_report_t {
+    uint8_t modifiers;
+    uint8_t bitmap[NKRO_BITMAP_LEN];
+} __attribute__((packed));
+
+// Must fit in the keyboard endpoint
+static_assert(sizeof(keyb_nkro_report_t) == 16, "NKRO report size mismatch");
+
+// keys[i] is the input bit that config.keycodes[i] is assigned to
+void nkro_init(const config_t& config, const uint16_t* keys, uint8_t num_keys);
+
+// inputs use the same bit layout as the remapped buttons, with JOY_BUTTON_13
+// and JOY_BUTTON_14 for digital TT
+void nkro_build_report(uint16_t inputs, keyb_nkro_report_t* report);
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef PROFILES_DEFINES_H
+#define PROFILES_DEFINES_H
+
+#include <stdint.h>
+#include <string.h>
+#include "config.h"
+#include "configloader.h"
+#include "config_schema.h"
+
+#define PROFILE_REPORT_ID 0xc3
+
+struct profile_report_t {
+    uint8_t report_id;
+    uint8_t active;
+    uint8_t count;
+    uint8_t pad;
+} __attribute__((packed));
+
+// All config profiles live in RAM; the active one is copied to the live
+// config, so switching never touches flash. The store (including the active
+// index) is saved in the background afterwards, encoded as described in
+// config_schema.h.
+class Profiles {
+    private:
+        Configloader& configloader;
+        config_t& live;
+
+        // Encoded copy handed to the configloader, so the store can keep
+        // changing while a save is in progress. Also used to read the store
+        // at boot.
+        uint8_t image[(CONFIG_ENCODED_MAX + 3) & ~3] __attribute__((aligned(4)));
+        bool save_pending = false;
+
+    public:
+        config_store_t store;
+
+        Profiles(Configloader& configloader, config_t& live) :
+            configloader(configloader), live(live) {}
+
+        // Decodes the stored config, whatever layout it was saved in
+        void load() {
+            uint32_t len = configloader.read(sizeof(image), image);
+            config_decode(image, len, store);
+
+            if (store.active_profile >= CONFIG_PROFILE_COUNT) {
+                store.active_profile = 0;
+            }
+
+            live = store.profiles[store.active_profile];
+        }
+
+        uint8_t active() {
+            return store.active_profile;
+        }
+
+        // Makes the profile live. Anything derived from the live config has to
+        // be re-applied by the caller.
+        bool select(uint8_t index) {
+            if (index >= CONFIG_PROFILE_COUNT) {
+                return false;
+            }
+
+            if (index != store.active_profile) {
+                store.active_profile = index;
+                save_pending = true;
+            }
+
+            live = store.profiles[index];
+            return true;
+        }
+
+        // Replaces the stored copy of the active profile. The live config is
+        // left alone, as before profiles existed: it applies from next boot
+        // (or the next switch to this profile).
+        void set_active_config(const config_t& config) {
+            store.profiles[store.active_profile] = config;
+            save_pending = true;
+        }
+
+        // Queues the save once the configloader is free. Must not run
+        // concurrently with select() or set_active_config().
+        void poll() {
+            if (!save_pending || configloader.busy()) {
+                return;
+            }
+
+            uint32_t len = config_encode(store, image);
+            save_pending = !configloader.write(len, image);
+        }
+
+        bool saving() {
+            return save_pending || configloader.busy();
+        }
+
+        void get_report(profile_report_t* report) {
+            report->report_id = PROFILE_REPORT_ID;
+            report->active = store.active_profile;
+            report->count = CONFIG_PROFILE_COUNT;
+            report->pad = 0;
+        }
+};
+
+#endif
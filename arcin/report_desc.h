@@ -5,6 +5,9 @@
 
 #include "usb_strings.h"
 #include "color.h"
+#include "nkro.h"
+#include "telemetry.h"
+#include "latency.h"
 
 constexpr HID_Item<uint8_t> string_index(uint8_t x) {
     return hid_item(0x78, x);
@@ -179,7 +182,38 @@ auto report_desc = gamepad(
     
     usage(0xc0ff),
     report_count(60),
-    feature(0x02) // Config data
+    feature(0x02), // Config data
+
+    // Segmented configuration
+    report_id(0xc1),
+
+    usage(0xc100),
+    report_count(1),
+    feature(0x02), // Segment
+
+    usage(0xc101),
+    feature(0x02), // Segment size
+
+    usage(0xc102),
+    feature(0x02), // Flags
+
+    usage(0xc1ff),
+    report_count(60),
+    feature(0x02), // Segment data
+
+    // Config save status
+    report_id(0xc2),
+
+    usage(0xc200),
+    report_count(7),
+    feature(0x02), // State, result, write and erase counts
+
+    // Config profile
+    report_id(0xc3),
+
+    usage(0xc300),
+    report_count(3),
+    feature(0x02) // Active profile, profile count, padding
 );
 
 auto keyb_report_desc = keyboard(
@@ -195,6 +229,75 @@ auto keyb_report_desc = keyboard(
     input(0x00)
 );
 
+#define KEYB_COMBINED_REPORT_ID 4
+
+// Single-interface alternative to report_desc + keyb_report_desc: the gamepad
+// collection followed by the keyboard under its own report ID.
+auto combined_report_desc = pack(
+    report_desc,
+    keyboard(
+        report_id(KEYB_COMBINED_REPORT_ID),
+        usage_page(UsagePage::Keyboard),
+        logical_minimum(0),
+        logical_maximum(255),
+        usage_minimum(0),
+        usage_maximum(255),
+        report_count(13),
+        report_size(8),
+        input(0x00)
+    )
+);
+
+// N-key rollover alternative to keyb_report_desc (see keyb_nkro_report_t)
+auto keyb_nkro_report_desc = keyboard(
+    usage_page(UsagePage::Keyboard),
+    logical_minimum(0),
+    logical_maximum(1),
+    report_size(1),
+
+    // Modifiers
+    usage_minimum(NKRO_MODIFIER_USAGE_MIN),
+    usage_maximum(NKRO_MODIFIER_USAGE_MAX),
+    report_count(8),
+    input(0x02),
+
+    // Bitmap
+    usage_minimum(0),
+    usage_maximum(NKRO_BITMAP_USAGE_MAX),
+    report_count(NKRO_BITMAP_LEN * 8),
+    input(0x02)
+);
+
+auto telemetry_report_desc = pack(
+    usage_page(0xff55),
+    usage(0x7e1e),
+    collection(Collection::Application,
+        logical_minimum(0),
+        logical_maximum(255),
+        report_size(8),
+
+        report_id(TELEMETRY_REPORT_ID),
+        usage(0x7e1e),
+        report_count(sizeof(telemetry_report_t) - 1),
+        input(0x02), // Telemetry
+
+        report_id(TELEMETRY_ENABLE_REPORT_ID),
+        usage(0x7e1e),
+        report_count(1),
+        feature(0x02), // Streaming enable
+
+        // Round-trip latency echo
+        report_id(ECHO_REPORT_ID),
+        usage(0xec00),
+        report_count(sizeof(echo_request_t) - 1),
+        output(0x02), // Token
+
+        usage(0xec01),
+        report_count(sizeof(echo_report_t) - 1),
+        input(0x02) // Token and timestamps
+    )
+);
+
 struct input_report_t {
     uint8_t report_id;
     uint16_t buttons;
@@ -202,6 +305,11 @@ struct input_report_t {
     uint8_t axis_y;
 } __attribute__((packed));
 
+struct keyb_combined_report_t {
+    uint8_t report_id;
+    uint8_t scancodes[13];
+} __attribute__((packed));
+
 struct output_report_t {
     uint8_t report_id;
     uint16_t leds;
@@ -108,6 +108,10 @@ class RGBManager {
     uint32_t last_hid_report = 0;
     uint32_t last_outdated_hid_check = 0;
 
+    // HID color waiting for the next frame
+    CRGB hid_color;
+    bool hid_color_pending = false;
+
     // reacting to tt movement (stationary / moving)
     // any movement instantly increases it to -127 or +127
     // no movement - slowly reaches 0 over time
@@ -346,7 +350,8 @@ class RGBManager {
         }
 
     public:
-        void init(rgb_config* config) {
+        // Colours, mode and timing. Can be called again at any time.
+        void configure(rgb_config* config) {
             // parse flags
             this->flags = config->Flags;
             this->tt_fade_out_time = 0;
@@ -373,6 +378,11 @@ class RGBManager {
                 (WS2812B_Mode)config->Mode,
                 (WS2812B_Palette)config->ColorPalette,
                 config->Multiplicity);
+        }
+
+        // Strip setup; once only
+        void init(rgb_config* config) {
+            configure(config);
 
             this->num_leds = config->NumberOfLeds;
             ws2812b_global.init(config->NumberOfLeds, config->Flags.FlipDirection);
@@ -383,15 +393,26 @@ class RGBManager {
             set_off();
         }
 
+        // Blanks the strip, even mid-frame; init() starts it again
+        void shutdown() {
+            ws2812b_global.stop();
+            set_off();
+        }
+
         void update_from_hid(ColorRgb color) {
             if (!global_led_enable || !flags.EnableHidControl) {
                 return;
             }
             last_hid_report = Time::time();
 
-            CRGB crgb;
-            crgb_from_colorrgb(color, crgb);
-            this->update_static(crgb);
+            // rendered on the next frame by update_colors
+            crgb_from_colorrgb(color, hid_color);
+            hid_color_pending = true;
+        }
+
+        // true if the next call to update_colors will render a frame
+        bool is_frame_due() {
+            return (Time::time() - last_outdated_hid_check) >= RGB_MANAGER_FRAME_MS;
         }
 
         // tt +1 is clockwise, -1 is counter-clockwise
@@ -406,6 +427,10 @@ class RGBManager {
 
             // if there was a HID report recently, don't take over control
             if ((last_hid_report != 0) && ((now - last_hid_report) < 5000)) {
+                if (hid_color_pending) {
+                    hid_color_pending = false;
+                    this->update_static(hid_color);
+                }
                 return;
             }
             if (!global_led_enable) {
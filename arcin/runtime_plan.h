@@ -0,0 +1,156 @@
+#ifndef RUNTIME_PLAN_DEFINES_H
+#define RUNTIME_PLAN_DEFINES_H
+
+#include <stdint.h>
+#include "config.h"
+#include "inf_defines.h"
+
+// Index into the tt_* tables with (tt1_report + 1)
+#define TT_PLAN_INDEX(report) ((report) + 1)
+
+// Fraction bits of runtime_plan_t::qe1_scale. Enough for the division by
+// -qe1_sens to be exact over the whole counter range (see build_runtime_plan)
+#define QE1_SCALE_SHIFT 23
+
+// The config and runtime mode switches, decoded into what the main loop
+// needs per iteration: masks and lookup tables instead of bitfield tests.
+// Whole stages are still switched on and off by the bools below, so the loop
+// does branch on them, but on plain bytes that don't change between
+// iterations. Built by build_runtime_plan() whenever any of its inputs
+// change.
+struct runtime_plan_t {
+    // raw button inputs that are read (button 9 is the WS2812B data line)
+    uint16_t button_mask;
+
+    bool mode_switch;
+    bool debounce_keys;
+    bool multi_function;
+    bool tt_accel;
+    bool tt_led_reactive;
+    bool ws2812b;
+
+    // [GAMEPAD]
+    bool gamepad_enabled;
+    uint16_t gamepad_button_mask;
+    uint16_t tt_buttons[3];
+
+    // [GAMEPAD] analog turntable;
+    // axis = ((count * qe1_scale) >> QE1_SCALE_SHIFT) ^ axis_xor
+    bool analog_axis;
+    uint32_t qe1_scale;
+    uint8_t axis_xor;
+
+    // [KEYBOARD] / [KEYBOARD NKRO]
+    bool keyboard_enabled;
+    uint16_t keyboard_mask;
+    uint16_t tt_keyboard_buttons[3];
+    uint8_t keyboard_key_count;
+    uint8_t tt_keycodes[3];
+};
+
+static void build_runtime_plan(
+    runtime_plan_t& plan,
+    const config_t& config,
+    config_flags flags,
+    bool reverse_tt,
+    uint8_t key_count) {
+
+    plan.button_mask = config.flags.Ws2812b ? (uint16_t)~ARCIN_PIN_BUTTON_9 : 0xffff;
+
+    plan.mode_switch = flags.ModeSwitchEnable;
+    plan.debounce_keys = flags.DebounceEnable;
+    plan.multi_function = flags.SelectMultiFunction;
+    plan.tt_accel = config.flags.TtAccelEnable;
+    plan.tt_led_reactive = flags.TtLedReactive;
+    plan.ws2812b = config.flags.Ws2812b;
+
+    plan.gamepad_enabled = !flags.JoyInputForceDisable;
+    plan.gamepad_button_mask = flags.JoyInputForceDisable ? 0 : 0xffff;
+
+    bool digital_tt = flags.DigitalTTEnable && !flags.JoyInputForceDisable;
+    plan.tt_buttons[TT_PLAN_INDEX(-1)] = digital_tt ? JOY_BUTTON_13 : 0;
+    plan.tt_buttons[TT_PLAN_INDEX(0)] = 0;
+    plan.tt_buttons[TT_PLAN_INDEX(1)] = digital_tt ? JOY_BUTTON_14 : 0;
+
+    plan.analog_axis =
+        !flags.JoyInputForceDisable &&
+        !(flags.DigitalTTEnable && !flags.AnalogTTForceEnable);
+    // count * qe1_sens, or count / -qe1_sens as a multiply by the rounded up
+    // reciprocal. That is exact while count * (rounding error) stays below
+    // 1 << QE1_SCALE_SHIFT; count < 256 * -qe1_sens (the counter range) and
+    // the error is below -qe1_sens <= 128, so the product is below 1 << 22.
+    if (config.qe1_sens < 0) {
+        uint32_t div = -config.qe1_sens;
+        plan.qe1_scale = ((1 << QE1_SCALE_SHIFT) + div - 1) / div;
+    } else {
+        uint32_t mul = (config.qe1_sens > 0) ? config.qe1_sens : 1;
+        plan.qe1_scale = mul << QE1_SCALE_SHIFT;
+    }
+
+    // 255 - x == x ^ 0xff for a byte
+    plan.axis_xor = reverse_tt ? 0xff : 0;
+
+    bool keyboard = flags.KeyboardEnable;
+    plan.keyboard_enabled = keyboard;
+    plan.keyboard_mask =
+        keyboard ? (INFINITAS_BUTTON_ALL | INFINITAS_EFFECTORS_ALL) : 0;
+    plan.tt_keyboard_buttons[TT_PLAN_INDEX(-1)] = keyboard ? JOY_BUTTON_13 : 0;
+    plan.tt_keyboard_buttons[TT_PLAN_INDEX(0)] = 0;
+    plan.tt_keyboard_buttons[TT_PLAN_INDEX(1)] = keyboard ? JOY_BUTTON_14 : 0;
+    plan.keyboard_key_count = keyboard ? key_count : 0;
+
+    // [11] = digital tt CW, [12] = digital tt CCW; 0 = no key
+    plan.tt_keycodes[TT_PLAN_INDEX(-1)] = keyboard ? config.keycodes[11] : 0;
+    plan.tt_keycodes[TT_PLAN_INDEX(0)] = 0;
+    plan.tt_keycodes[TT_PLAN_INDEX(1)] = keyboard ? config.keycodes[12] : 0;
+}
+
+// The report contents the main loop builds from the plan each iteration
+
+// [GAMEPAD] buttons, with the digital turntable
+static inline uint16_t plan_gamepad_buttons(
+    const runtime_plan_t& plan, uint16_t remapped, int8_t tt1_report) {
+
+    return (remapped | plan.tt_buttons[TT_PLAN_INDEX(tt1_report)]) &
+        plan.gamepad_button_mask;
+}
+
+// [GAMEPAD] X axis: the analog turntable, scaled by its sensitivity
+static inline uint8_t plan_axis_x(const runtime_plan_t& plan, uint32_t qe1_count) {
+    if (!plan.analog_axis) {
+        return 127;
+    }
+
+    return uint8_t(((uint64_t)qe1_count * plan.qe1_scale) >> QE1_SCALE_SHIFT) ^ plan.axis_xor;
+}
+
+// [KEYBOARD NKRO] inputs that have a key
+static inline uint16_t plan_keyboard_inputs(
+    const runtime_plan_t& plan, uint16_t remapped, int8_t tt1_report) {
+
+    return (remapped & plan.keyboard_mask) |
+        plan.tt_keyboard_buttons[TT_PLAN_INDEX(tt1_report)];
+}
+
+// [KEYBOARD] scancodes for the pressed keys, then the turntable's (0 if it
+// didn't move). scancodes must have room for key_count + 1.
+static inline void plan_scancodes(
+    const runtime_plan_t& plan,
+    const uint16_t* keys,
+    const char* keycodes,
+    uint16_t remapped,
+    int8_t tt1_report,
+    uint8_t* scancodes) {
+
+    uint8_t nextscan = 0;
+
+    for (uint8_t i = 0; i < plan.keyboard_key_count; i++) {
+        if (remapped & keys[i]) {
+            scancodes[nextscan++] = keycodes[i];
+        }
+    }
+
+    scancodes[nextscan] = plan.tt_keycodes[TT_PLAN_INDEX(tt1_report)];
+}
+
+#endif
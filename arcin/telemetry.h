@@ -0,0 +1,178 @@
+#ifndef TELEMETRY_DEFINES_H
+#define TELEMETRY_DEFINES_H
+
+#include <stdint.h>
+#include <string.h>
+#include <os/time.h>
+#include "timer.h"
+#include "latency.h"
+
+#define TELEMETRY_REPORT_ID         0x01
+#define TELEMETRY_ENABLE_REPORT_ID  0x02
+
+// Gamepad report timestamps per telemetry report
+#define TELEMETRY_LATENCY_EVENTS    2
+
+// One report per millisecond, covering everything that happened during it
+struct telemetry_report_t {
+    uint8_t report_id;
+    uint8_t sequence;
+    // snapshots that were overwritten before the host picked them up
+    uint8_t dropped;
+    uint8_t gamepad_reports;
+    uint32_t time_ms;
+    uint32_t loop_count;
+    uint16_t loop_time_max_us;
+    uint16_t debounce_changes;
+    // raw QE1 count at the end of the millisecond
+    uint32_t tt_count;
+    uint16_t gamepad_write_max_us;
+    uint16_t keyboard_write_max_us;
+    uint8_t keyboard_reports;
+    uint8_t latency_count;
+    uint16_t rgb_frame_max_us;
+    // gamepad reports the host picked up since the last telemetry report
+    // (see LatencyTracker); more wait for the next one
+    latency_event_t latency[TELEMETRY_LATENCY_EVENTS];
+} __attribute__((packed));
+
+static_assert(sizeof(telemetry_report_t) <= 64, "telemetry report too large");
+
+struct telemetry_enable_report_t {
+    uint8_t report_id;
+    uint8_t enable;
+} __attribute__((packed));
+
+// Collects per-millisecond timing statistics for the telemetry interface.
+// Everything is a no-op until the host enables streaming, so callers only pay
+// for the enabled check.
+class Telemetry {
+    private:
+        telemetry_report_t current;
+        telemetry_report_t pending;
+        bool pending_valid;
+        uint8_t sequence;
+
+        uint32_t last_loop_us;
+        uint16_t last_debounced;
+
+        void snapshot(uint32_t now_ms) {
+            if (pending_valid) {
+                current.dropped = pending.dropped + 1;
+            }
+
+            current.report_id = TELEMETRY_REPORT_ID;
+            current.sequence = sequence++;
+            pending = current;
+            pending_valid = true;
+
+            memset(&current, 0, sizeof(current));
+            current.time_ms = now_ms;
+        }
+
+        static uint16_t update_max(uint16_t max_us, uint32_t us) {
+            if (us > UINT16_MAX) {
+                us = UINT16_MAX;
+            }
+
+            return (max_us < us) ? us : max_us;
+        }
+
+    public:
+        bool enabled = false;
+
+        void enable(bool on) {
+            memset(&current, 0, sizeof(current));
+            current.time_ms = Time::time();
+            pending_valid = false;
+            sequence = 0;
+            last_loop_us = time_us();
+            last_debounced = 0;
+            enabled = on;
+        }
+
+        // Top of every main loop iteration
+        void loop() {
+            if (!enabled) {
+                return;
+            }
+
+            uint32_t now_us = time_us();
+            uint32_t now_ms = Time::time();
+            if (now_ms != current.time_ms) {
+                snapshot(now_ms);
+            }
+
+            current.loop_count += 1;
+            current.loop_time_max_us =
+                update_max(current.loop_time_max_us, now_us - last_loop_us);
+            last_loop_us = now_us;
+        }
+
+        void debounced(uint16_t buttons) {
+            if (!enabled) {
+                return;
+            }
+
+            current.debounce_changes += __builtin_popcount(buttons ^ last_debounced);
+            last_debounced = buttons;
+        }
+
+        void tt_count(uint32_t count) {
+            if (!enabled) {
+                return;
+            }
+
+            current.tt_count = count;
+        }
+
+        // Returns the start time to pass to *_written()
+        uint32_t start() {
+            if (!enabled) {
+                return 0;
+            }
+
+            return time_us();
+        }
+
+        void gamepad_written(uint32_t start_us) {
+            if (!enabled) {
+                return;
+            }
+
+            current.gamepad_reports += 1;
+            current.gamepad_write_max_us =
+                update_max(current.gamepad_write_max_us, time_us() - start_us);
+        }
+
+        void keyboard_written(uint32_t start_us) {
+            if (!enabled) {
+                return;
+            }
+
+            current.keyboard_reports += 1;
+            current.keyboard_write_max_us =
+                update_max(current.keyboard_write_max_us, time_us() - start_us);
+        }
+
+        void rgb_frame(uint32_t start_us) {
+            if (!enabled) {
+                return;
+            }
+
+            current.rgb_frame_max_us =
+                update_max(current.rgb_frame_max_us, time_us() - start_us);
+        }
+
+        // Returns the completed snapshot to send, if there is one
+        telemetry_report_t* get_pending() {
+            if (!enabled || !pending_valid) {
+                return nullptr;
+            }
+
+            pending_valid = false;
+            return &pending;
+        }
+};
+
+#endif
@@ -3,6 +3,21 @@
 
 #include <stdint.h>
 #include <os/time.h>
+#include <interrupt/interrupt.h>
+
+// Microseconds since boot (wraps after ~71 minutes). SysTick counts down from
+// STK.LOAD once every millisecond.
+static inline uint32_t time_us() {
+    uint32_t ms;
+    uint32_t val;
+
+    do {
+        ms = Time::time();
+        val = STK.VAL;
+    } while (ms != Time::time());
+
+    return (ms * 1000) + (((STK.LOAD - val) * 1000) / (STK.LOAD + 1));
+}
 
 class timer {
 private:
@@ -0,0 +1,169 @@
+#ifndef TT_ACCEL_DEFINES_H
+#define TT_ACCEL_DEFINES_H
+
+#include <stdint.h>
+#include <os/time.h>
+
+// Speed is measured as the number of QE1 counts travelled over this window.
+#define TT_ACCEL_WINDOW_MS 8
+
+// Number of entries in the precomputed curve (indexed by speed). Anything
+// faster than the last entry uses the last entry.
+#define TT_ACCEL_CURVE_LEN 64
+
+// Control point gains in config are 3.5 fixed point (32 = 1.0x)
+#define TT_ACCEL_GAIN_ONE 32
+
+// Gains in the precomputed curve are 8.8 fixed point (256 = 1.0x)
+#define TT_ACCEL_FRAC_BITS 8
+
+#define TT_ACCEL_POINT_COUNT 3
+
+// Speed (counts per window) of each control point in config.tt_accel_curve
+static const uint8_t tt_accel_points[TT_ACCEL_POINT_COUNT] = {
+    0, 16, TT_ACCEL_CURVE_LEN - 1
+};
+
+class tt_accel {
+    // gain for each speed, 8.8 fixed point
+    uint16_t curve[TT_ACCEL_CURVE_LEN];
+
+    // counts travelled during each of the last TT_ACCEL_WINDOW_MS milliseconds
+    uint16_t window[TT_ACCEL_WINDOW_MS];
+    uint8_t window_index;
+    uint32_t window_time;
+    uint32_t speed;
+
+    // counter modulus (TIMx.ARR + 1)
+    uint32_t range;
+
+    uint32_t last_raw;
+    bool last_raw_valid;
+
+    // accelerated count, wraps around at range
+    uint32_t position;
+
+    // fractional counts not reported yet (TT_ACCEL_FRAC_BITS). Carrying this
+    // over means the curve never adds or loses counts to rounding.
+    int32_t residual;
+
+    static uint16_t gain_from_config(uint8_t gain) {
+        // unset control points behave as 1.0x
+        if (gain == 0) {
+            gain = TT_ACCEL_GAIN_ONE;
+        }
+
+        return ((uint16_t)gain) << (TT_ACCEL_FRAC_BITS - 5);
+    }
+
+    void advance_window(uint32_t now) {
+        uint32_t elapsed = now - window_time;
+        if (elapsed > TT_ACCEL_WINDOW_MS) {
+            elapsed = TT_ACCEL_WINDOW_MS;
+        }
+
+        for (uint32_t i = 0; i < elapsed; i++) {
+            window_index = (window_index + 1) % TT_ACCEL_WINDOW_MS;
+            speed -= window[window_index];
+            window[window_index] = 0;
+        }
+
+        window_time = now;
+    }
+
+public:
+    tt_accel() : range(256) {
+        reset();
+    }
+
+    // Precompute the curve from the control points by linear interpolation.
+    // Gains are forced to be non-decreasing so that a faster spin never
+    // produces less movement than a slower one.
+    void init(const uint8_t* control_points, uint32_t range) {
+        this->range = range;
+
+        uint16_t gains[TT_ACCEL_POINT_COUNT];
+        for (uint8_t i = 0; i < TT_ACCEL_POINT_COUNT; i++) {
+            gains[i] = gain_from_config(control_points[i]);
+            if (0 < i && gains[i] < gains[i - 1]) {
+                gains[i] = gains[i - 1];
+            }
+        }
+
+        uint8_t segment = 0;
+        for (uint32_t s = 0; s < TT_ACCEL_CURVE_LEN; s++) {
+            while ((segment + 2) < TT_ACCEL_POINT_COUNT &&
+                   tt_accel_points[segment + 1] <= s) {
+                segment += 1;
+            }
+
+            uint32_t x0 = tt_accel_points[segment];
+            uint32_t x1 = tt_accel_points[segment + 1];
+            int32_t y0 = gains[segment];
+            int32_t y1 = gains[segment + 1];
+
+            if (x1 <= s) {
+                curve[s] = y1;
+            } else {
+                curve[s] = y0 + (y1 - y0) * (int32_t)(s - x0) / (int32_t)(x1 - x0);
+            }
+        }
+
+        reset();
+    }
+
+    void reset() {
+        for (uint8_t i = 0; i < TT_ACCEL_WINDOW_MS; i++) {
+            window[i] = 0;
+        }
+        window_index = 0;
+        window_time = 0;
+        speed = 0;
+        last_raw = 0;
+        last_raw_valid = false;
+        position = 0;
+        residual = 0;
+    }
+
+    uint16_t get_gain(uint32_t speed) {
+        if (TT_ACCEL_CURVE_LEN <= speed) {
+            speed = TT_ACCEL_CURVE_LEN - 1;
+        }
+
+        return curve[speed];
+    }
+
+    // Takes the raw counter value and returns the accelerated counter value,
+    // in the same range.
+    uint32_t poll(uint32_t raw) {
+        if (!last_raw_valid) {
+            last_raw_valid = true;
+            last_raw = raw;
+            position = raw;
+        }
+
+        // shortest signed distance, accounting for counter wraparound
+        int32_t delta = (int32_t)((raw + range - last_raw) % range);
+        if ((uint32_t)delta > (range / 2)) {
+            delta -= range;
+        }
+        last_raw = raw;
+
+        advance_window(Time::time());
+
+        uint16_t magnitude = (delta < 0) ? -delta : delta;
+        window[window_index] += magnitude;
+        speed += magnitude;
+
+        int32_t scaled = (delta * (int32_t)get_gain(speed)) + residual;
+
+        // floor division, so residual always stays in [0, 1.0)
+        int32_t counts = scaled >> TT_ACCEL_FRAC_BITS;
+        residual = scaled - (counts * (1 << TT_ACCEL_FRAC_BITS));
+
+        position = (position + range + (counts % (int32_t)range)) % range;
+        return position;
+    }
+};
+
+#endif
@@ -104,6 +104,16 @@ class WS2812B {
             schedule_dma();
         }
 
+        // Cuts short the frame in progress, if any. cnt goes first, so a
+        // transfer completing meanwhile doesn't schedule the next LED.
+        void stop() {
+            cnt = 0;
+            DMA1.reg.C[6].CR = 0;
+            DMA1.reg.IFCR = 1 << 24;
+            TIM4.CCR3 = 0;
+            busy = false;
+        }
+
         uint8_t get_num_leds() {
             return this->num_leds;
         }
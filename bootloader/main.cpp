@@ -7,11 +7,130 @@
 #include <usb/descriptor.h>
 #include <usb/hid.h>
 
+#include <string.h>
+
+#include "../arcin/crc32.h"
+#include "../arcin/bootslot.h"
+
 static uint32_t& reset_reason = *(uint32_t*)0x10000000;
-static const uint32_t* firmware_vtors = (uint32_t*)0x8002000;
+
+static const uint32_t page_size = 2048;
+
+// Flash must be unlocked for these. erase_page() only starts the erase.
+
+void erase_page(uint32_t addr) {
+	FLASH.CR = 1 << 1; // PER
+	FLASH.AR = addr;
+	FLASH.CR = (1 << 6) | (1 << 1); // STRT, PER
+}
+
+// Waits for the operation in progress, and clears any error it had
+bool flash_wait() {
+	while(FLASH.SR & (1 << 0)); // BSY
+	
+	FLASH.CR = 0;
+	
+	if(FLASH.SR & ((1 << 2) | (1 << 4))) { // PGERR, WRPRTERR
+		FLASH.SR = (1 << 2) | (1 << 4);
+		return false;
+	}
+	
+	return true;
+}
+
+// Synchronous, for the few halfwords of slot info
+bool program_halfword(const void* addr, uint16_t value) {
+	FLASH.CR = 1 << 0; // PG
+	
+	*(volatile uint16_t*)addr = value;
+	
+	return flash_wait();
+}
+
+// Marks an unconfirmed slot tried before booting it (one more of its
+// SLOT_TRIAL_ATTEMPTS), with the watchdog running in case it hangs. Images that can't confirm their slot (older
+// firmware, or flashed by an older bootloader) are trusted as they are: the
+// watchdog can't be stopped, and they would never feed it.
+void begin_trial(uint32_t slot) {
+	const slot_info_t* info = slot_info(slot);
+	
+	if(info->confirms != SLOT_FLAG_SET || info->confirmed == SLOT_FLAG_SET) {
+		return;
+	}
+	
+	// Unlock flash.
+	FLASH.KEYR = 0x45670123;
+	FLASH.KEYR = 0xCDEF89AB;
+	
+	program_halfword(slot_next_trial(info), SLOT_FLAG_SET);
+	
+	FLASH.CR = 1 << 7; // LOCK
+	
+	iwdg_start();
+}
 
 static bool do_reset;
 
+// Input report: flashing progress, sent periodically. The host works out the
+// throughput from bytes_programmed and elapsed_ms.
+struct flash_status_t {
+	uint8_t state; // 1 = flashing
+	uint8_t error;
+	uint8_t queued; // blocks waiting to be programmed
+	uint8_t pages_erased;
+	uint32_t bytes_received;
+	uint32_t bytes_programmed;
+	uint32_t elapsed_ms; // since prepare, up to finish
+} __attribute__((packed));
+
+// Minimum time between status reports
+static const uint32_t status_interval_ms = 20;
+
+// Commands: feature function 0x23, then an output report
+//
+//   uint8_t   command
+//   uint8_t   padding[3]
+//   uint32_t  arguments
+//
+// 0x30  CRC32 of a flash range, so the host can verify what was written
+//       without reading it back. Arguments: offset from the start of flash
+//       and length, in bytes, both whole words.
+//
+// 0x31  CRC32 of each of up to 15 firmware pages of a slot. Arguments: first
+//       page, count, and 0 for the slot being flashed or 1 for the other
+//       (running) one. The host compares them with its image to find the
+//       pages that changed, and those it can copy from the other slot.
+//
+// 0x32  While flashing, continue at a page of the slot. Only the pages
+//       written to are erased. Argument: page.
+//
+// 0x33  While flashing, the length of the image in bytes, a whole number of
+//       words. Incremental flashing doesn't write the whole image, so it
+//       needs this before finish(). Argument: length.
+//
+// 0x34  While flashing, copy pages from the other slot to the same pages of
+//       this one, and continue after them. Not the first page, whose vector
+//       table is linked for its slot. Arguments: first page, count.
+//
+// A command that fails is refused like any other output report. Otherwise
+// the reply is the next input report, ahead of any status.
+struct command_reply_t {
+	uint8_t marker; // 0x80, never a status state
+	uint8_t command;
+	uint8_t count; // words of data
+	uint8_t reserved;
+	uint32_t data[15];
+} __attribute__((packed));
+
+static command_reply_t command_reply;
+static bool command_reply_pending;
+
+static const uint32_t flash_base = 0x8000000;
+static const uint32_t flash_size = 256 * 1024;
+
+// Slot the next flash goes to: the one not being booted
+static uint32_t flash_target;
+
 void reset() {
 	SCB.AIRCR = (0x5fa << 16) | (1 << 2); // SYSRESETREQ
 }
@@ -29,10 +148,12 @@ auto report_desc = pack(
 			logical_minimum(0),
 			logical_maximum(255),
 			report_size(8),
-			report_count(1),
+			report_count(64),
 			
 			usage(0xb007),
-			input(0x02), // Status
+			input(0x02), // Status, command reply
+			
+			report_count(1),
 			
 			usage(0xb007),
 			feature(0x02), // Function
@@ -68,81 +189,443 @@ static Pin led2 = GPIOA[9];
 
 USB_f1 usb(USB, dev_desc_p, conf_desc_p);
 
+// Firmware blocks are queued as they arrive and acknowledged right away;
+// poll() programs them from the main loop, one halfword at a time, so the
+// host can send the next block while the previous one is being programmed.
+// Pages are erased ahead of the programming address whenever nothing is
+// queued, starting with the first pages right after prepare().
+//
+// The CPU still stalls while the flash is busy (there is only one bank), but
+// the USB peripheral keeps receiving and NAKs the host meanwhile, instead of
+// the host waiting for each block to be programmed before sending the next.
+//
+// A programming error is reported by the next write_block() or finish().
+//
+// In incremental flashing (prepare(true), or any seek()), only the pages the
+// host writes to are erased and programmed, and the rest of the slot is left
+// as is. The host then gives the image length (set_length()), as the slot
+// past the image may still hold an older, longer one. Pages the running
+// image already has are copied from the other slot (copy()) instead of
+// sent: poll() queues them as if they had come from the host.
 class Flashloader {
 	private:
+		enum {
+			PAGE_SIZE = 2048,
+			BLOCK_SIZE = 64,
+			QUEUE_LEN = 8,
+			
+			// Pages erased ahead of the last queued block
+			ERASE_AHEAD = 2,
+		};
+		
+		struct block_t {
+			uint32_t addr;
+			uint32_t size;
+			uint16_t data[BLOCK_SIZE / 2];
+		};
+		
+		block_t queue[QUEUE_LEN];
+		uint8_t queue_head;
+		uint8_t queue_count;
+		uint32_t next_halfword;
+		
 		bool state;
+		bool error;
+		bool erasing;
+		bool incremental;
+		
+		// slot being flashed
+		uint32_t slot_index;
+		const boot_slot_t* slot;
+		
+		// next block goes here
 		uint32_t addr;
-	
+		
+		// from set_length(), or 0
+		uint32_t length;
+		
+		// copy(): next block of the other slot, and where in this slot the
+		// copy stops (0 when not copying)
+		uint32_t copy_src;
+		uint32_t copy_end;
+		
+		// everything from the slot start (or the last seek) up to here is
+		// erased
+		uint32_t erased_end;
+		
+		// progress
+		uint32_t bytes_received;
+		uint32_t bytes_programmed;
+		uint8_t pages_erased;
+		uint32_t start_time;
+		uint32_t end_time;
+		
+		void queue_block(uint32_t size, const void* data) {
+			block_t& block = queue[(queue_head + queue_count) % QUEUE_LEN];
+			block.addr = addr;
+			block.size = size;
+			memcpy(block.data, data, size);
+			queue_count++;
+			
+			addr += size;
+		}
+		
+		bool copying() {
+			return addr < copy_end;
+		}
+		
+		// Until everything queued or being copied is programmed
+		void drain() {
+			while(queue_count || erasing || copying()) {
+				poll();
+			}
+		}
+		
+		void start_erase() {
+			erase_page(erased_end);
+			erasing = true;
+		}
+		
+		// Slot info is small enough to write synchronously
+		bool write_info_word(const uint32_t* field, uint32_t value) {
+			const uint16_t* dest = (const uint16_t*)field;
+			
+			return
+				program_halfword(dest, value) &&
+				program_halfword(dest + 1, value >> 16);
+		}
+		
+		// Until complete_info(), the slot won't boot
+		bool begin_info() {
+			erase_page(slot->info);
+			
+			return
+				flash_wait() &&
+				write_info_word(&slot_info(slot_index)->started, SLOT_STARTED);
+		}
+		
+		bool complete_info() {
+			const slot_info_t* info = slot_info(slot_index);
+			
+			// Without a length from the host, the image ends where writing
+			// did. Incremental flashing skips pages, so it needs one.
+			uint32_t image_length = length ? length : addr - slot->start;
+			
+			if(incremental && !length) {
+				return false;
+			}
+			
+			// Newer than the other slot
+			uint32_t other_sequence;
+			check_slot(1 - slot_index, &other_sequence);
+			
+			return
+				write_info_word(&info->length, image_length) &&
+				write_info_word(&info->crc, crc32((void*)slot->start, image_length)) &&
+				write_info_word(&info->sequence, other_sequence + 1) &&
+				(!image_confirms_slot(slot->start, image_length) ||
+				 program_halfword(&info->confirms, SLOT_FLAG_SET)) &&
+				write_info_word(&info->complete, SLOT_COMPLETE);
+		}
+		
 	public:
-		Flashloader() : state(false) {}
+		Flashloader() :
+			queue_count(0), state(false), error(false), erasing(false),
+			incremental(false), bytes_received(0), bytes_programmed(0), pages_erased(0) {}
 		
-		bool prepare() {
-			addr = 0x8002000;
+		bool prepare(bool incremental_flash = false) {
+			// Anything still in progress from an earlier attempt
+			while(FLASH.SR & (1 << 0)); // BSY
+			
+			slot_index = flash_target;
+			slot = &boot_slots[slot_index];
+			
+			addr = slot->start;
+			length = 0;
+			copy_end = 0;
+			erased_end = addr;
+			queue_head = 0;
+			queue_count = 0;
+			next_halfword = 0;
+			error = false;
+			erasing = false;
+			incremental = incremental_flash;
+			bytes_received = 0;
+			bytes_programmed = 0;
+			pages_erased = 0;
+			start_time = Time::time();
 			state = true;
 			
 			// Unlock flash.
 			FLASH.KEYR = 0x45670123;
 			FLASH.KEYR = 0xCDEF89AB;
 			
+			if(!begin_info()) {
+				error = true;
+				return false;
+			}
+			
 			return true;
 		}
 		
 		bool write_block(uint32_t size, void* data) {
-			if(!state) {
+			if(!state || error) {
 				return false;
 			}
 			
-			if(size & 1) {
+			if(size & 1 || size > BLOCK_SIZE) {
 				return false;
 			}
 			
-			if(addr + size > 0x8020000) {
+			if(addr + size > slot->end) {
 				return false;
 			}
 			
-			if(!(addr & (2048 - 1))) {
-				// Erase page.
+			// An image linked for the other slot would not run from this one
+			if(addr == slot->start) {
+				uint32_t reset_vector = ((uint32_t*)data)[1];
 				
-				FLASH.CR = 1 << 1; // PER
-				FLASH.AR = addr;
-				FLASH.CR = (1 << 6) | (1 << 1); // STRT, PER
+				if(size < 8 || reset_vector < slot->start || reset_vector >= slot->end) {
+					return false;
+				}
+			}
+			
+			// Queue full (or a copy still going); the host waits for the
+			// acknowledgement meanwhile
+			while(queue_count == QUEUE_LEN || copying()) {
+				poll();
 				
-				while(FLASH.SR & (1 << 0)); // BSY
+				if(error) {
+					return false;
+				}
+			}
+			
+			queue_block(size, data);
+			bytes_received += size;
+			return true;
+		}
+		
+		// Advances the queue by at most one flash operation, without waiting
+		// for it to finish.
+		void poll() {
+			if(!state) {
+				return;
+			}
+			
+			if(FLASH.SR & (1 << 0)) { // BSY
+				return;
+			}
+			
+			if(FLASH.SR & ((1 << 2) | (1 << 4))) { // PGERR, WRPRTERR
+				FLASH.SR = (1 << 2) | (1 << 4);
+				FLASH.CR = 0;
 				
+				error = true;
+				erasing = false;
+				queue_count = 0;
+				copy_end = 0;
+				return;
+			}
+			
+			if(copying() && queue_count < QUEUE_LEN) {
+				queue_block(BLOCK_SIZE, (const void*)copy_src);
+				copy_src += BLOCK_SIZE;
+			}
+			
+			if(erasing) {
 				FLASH.SR &= ~(1 << 5); // EOP
 				FLASH.CR = 0;
+				
+				erasing = false;
+				erased_end += PAGE_SIZE;
+				pages_erased++;
+				return;
 			}
 			
-			uint16_t* src = (uint16_t*)data;
-			uint16_t* dest = (uint16_t*)addr;
-			
-			for(uint32_t n = 0; n < size; n += 2) {
+			if(queue_count) {
+				block_t& block = queue[queue_head];
+				
+				if(block.addr + block.size > erased_end) {
+					start_erase();
+					return;
+				}
+				
 				FLASH.CR = 1 << 0; // PG
 				
-				*dest++ = *src++;
+				((uint16_t*)block.addr)[next_halfword] = block.data[next_halfword];
+				next_halfword++;
 				
-				while(FLASH.SR & (1 << 0)); // BSY
+				if(next_halfword * 2 >= block.size) {
+					next_halfword = 0;
+					queue_head = (queue_head + 1) % QUEUE_LEN;
+					queue_count--;
+					bytes_programmed += block.size;
+				}
+				return;
 			}
 			
+			// Nothing to program, get the next pages ready. Not when
+			// incremental, the next page may well be unchanged.
+			if(!incremental &&
+			   erased_end < addr + ERASE_AHEAD * PAGE_SIZE && erased_end < slot->end) {
+				start_erase();
+			}
+		}
+		
+		// Continues writing at the start of a page; the blocks queued so far
+		// are programmed first.
+		bool seek(uint32_t page_addr) {
+			if(!state || error) {
+				return false;
+			}
 			
-			addr += size;
+			if(page_addr & (PAGE_SIZE - 1) || page_addr < slot->start || page_addr >= slot->end) {
+				return false;
+			}
+			
+			drain();
+			
+			addr = page_addr;
+			erased_end = page_addr;
+			incremental = true;
+			
+			return !error;
+		}
+		
+		// Continues at the start of a page with pages copied from the same
+		// place in the other slot, programmed in the background
+		bool copy(uint32_t page_addr, uint32_t count) {
+			if(!state || page_addr == slot->start || !seek(page_addr)) {
+				return false;
+			}
+			
+			if(count > (slot->end - page_addr) / PAGE_SIZE) {
+				return false;
+			}
+			
+			copy_src = boot_slots[1 - slot_index].start + (page_addr - slot->start);
+			copy_end = page_addr + count * PAGE_SIZE;
+			return true;
+		}
+		
+		bool set_length(uint32_t image_length) {
+			if(!state || error) {
+				return false;
+			}
+			
+			if(image_length & 3 || image_length < 8 || image_length > slot->end - slot->start) {
+				return false;
+			}
+			
+			length = image_length;
 			return true;
 		}
 		
 		bool finish() {
+			if(!state) {
+				return false;
+			}
+			
+			drain();
+			
+			if(!error && !complete_info()) {
+				error = true;
+			}
+			
+			end_time = Time::time();
 			state = false;
 			
 			FLASH.CR = 1 << 7; // LOCK
 			
-			return true;
+			return !error;
+		}
+		
+		void get_status(flash_status_t* status) {
+			uint32_t now = state ? Time::time() : end_time;
+			
+			status->state = state;
+			status->error = error;
+			status->queued = queue_count;
+			status->pages_erased = pages_erased;
+			status->bytes_received = bytes_received;
+			status->bytes_programmed = bytes_programmed;
+			status->elapsed_ms = bytes_received ? now - start_time : 0;
 		}
 };
 
 Flashloader flashloader;
 
 class HID_bootloader : public USB_HID {
+	private:
+		// The next output report is a command
+		bool command_next;
+		
+		bool run_command(const uint32_t* buf) {
+			const uint32_t* args = buf + 1;
+			command_reply_t& reply = command_reply;
+			
+			memset(&reply, 0, sizeof(reply));
+			reply.marker = 0x80;
+			reply.command = buf[0] & 0xff;
+			
+			switch(reply.command) {
+				case 0x30:
+					if((args[0] | args[1]) & 3 || args[0] > flash_size || args[1] > flash_size - args[0]) {
+						return false;
+					}
+					
+					reply.data[0] = crc32((void*)(flash_base + args[0]), args[1]);
+					reply.count = 1;
+					break;
+				
+				case 0x31:
+					{
+						if(args[2] > 1) {
+							return false;
+						}
+						
+						const boot_slot_t& slot = boot_slots[args[2] ? 1 - flash_target : flash_target];
+						uint32_t pages = (slot.end - slot.start) / page_size;
+						
+						if(args[1] > 15 || args[0] > pages || args[1] > pages - args[0]) {
+							return false;
+						}
+						
+						for(uint32_t n = 0; n < args[1]; n++) {
+							reply.data[n] = crc32((void*)(slot.start + (args[0] + n) * page_size), page_size);
+						}
+						reply.count = args[1];
+					}
+					break;
+				
+				case 0x32:
+					if(!flashloader.seek(boot_slots[flash_target].start + args[0] * page_size)) {
+						return false;
+					}
+					break;
+				
+				case 0x33:
+					if(!flashloader.set_length(args[0])) {
+						return false;
+					}
+					break;
+				
+				case 0x34:
+					if(!flashloader.copy(boot_slots[flash_target].start + args[0] * page_size, args[1])) {
+						return false;
+					}
+					break;
+				
+				default:
+					return false;
+			}
+			
+			command_reply_pending = true;
+			return true;
+		}
+	
 	public:
-		HID_bootloader(USB_generic& usbd, desc_t rdesc) : USB_HID(usbd, rdesc, 0, 1, 64) {}
+		HID_bootloader(USB_generic& usbd, desc_t rdesc) : USB_HID(usbd, rdesc, 0, 1, 64), command_next(false) {}
 	
 	protected:
 		virtual bool set_output_report(uint32_t* buf, uint32_t len) {
@@ -150,9 +633,24 @@ class HID_bootloader : public USB_HID {
 				return false;
 			}
 			
+			if(command_next) {
+				command_next = false;
+				return run_command(buf);
+			}
+			
 			return flashloader.write_block(len, buf);
 		}
 		
+		// Feature report: the slot the next flash goes to, so the host can
+		// send the image linked for it.
+		virtual bool get_feature_report(uint8_t report_id) {
+			uint32_t target = flash_target;
+			
+			usb.write(0, &target, 1);
+			
+			return true;
+		}
+		
 		virtual bool set_feature_report(uint32_t* buf, uint32_t len) {
 			if(len != 1) {
 				return false;
@@ -170,11 +668,16 @@ class HID_bootloader : public USB_HID {
 					return true;
 				
 				case 0x20: // Flash prepare
-					return flashloader.prepare();
+				case 0x24: // Flash prepare, incremental
+					return flashloader.prepare((*buf & 0xff) == 0x24);
 				
 				case 0x21: // Flash finish
 					return flashloader.finish();
 				
+				case 0x23: // Command follows
+					command_next = true;
+					return true;
+				
 				default:
 					return false;
 			}
@@ -264,12 +767,6 @@ bool normal_boot() {
 		return false;
 	}
 	
-	// Check that reset vector is a valid flash address.
-	uint32_t reset_vector = firmware_vtors[1];
-	if(reset_vector < 0x8002000 || reset_vector >= 0x8020000) {
-		return false;
-	}
-	
 	// No reason to enter bootloader.
 	return true;
 }
@@ -287,10 +784,18 @@ int main() {
 	led1.set_mode(Pin::Output);
 	led2.set_mode(Pin::Output);
 	
-	if(normal_boot()) {
-		chainload(0x8002000);
+	crc32_init();
+	
+	// Newest intact image; the other slot gets flashed.
+	int slot = select_slot();
+	
+	if(normal_boot() && slot >= 0) {
+		begin_trial(slot);
+		chainload(boot_slots[slot].start);
 	}
 	
+	flash_target = slot == 0 ? 1 : 0;
+	
 	rcc_init();
 	
 	// Initialize system timer.
@@ -310,9 +815,34 @@ int main() {
 	usb_pu.on();
 	
 	
+	flash_status_t status_sent = {};
+	uint32_t status_time = 0;
+	
 	while(1) {
 		usb.process();
 		
+		flashloader.poll();
+		
+		// Progress, whenever it changed (so nothing before the first prepare)
+		flash_status_t status;
+		flashloader.get_status(&status);
+		
+		if(command_reply_pending && usb.ep_ready(1)) {
+			usb.write(1, (uint32_t*)&command_reply, sizeof(command_reply));
+			command_reply_pending = false;
+		}
+		
+		if(memcmp(&status, &status_sent, sizeof(status)) &&
+		   Time::time() - status_time >= status_interval_ms &&
+		   usb.ep_ready(1)) {
+			uint32_t report[16] = {};
+			memcpy(report, &status, sizeof(status));
+			
+			usb.write(1, report, sizeof(report));
+			status_sent = status;
+			status_time = Time::time();
+		}
+		
 		if(do_reset) {
 			Time::sleep(10);
 			reset();
@@ -0,0 +1,208 @@
+#!/usr/bin/env python
+
+# Incremental flashing: find the firmware pages that differ from what the
+# bootloader reports for the slot being flashed (command 0x31), and write only
+# those (command 0x32 to skip ahead), then give the image length (command
+# 0x33). See the commands in bootloader/main.cpp.
+#
+# The slot being flashed holds the firmware from two flashes ago (or nothing,
+# right after moving to two slots), so pages are also compared with the
+# running slot; those that match are copied from it (command 0x34) instead of
+# sent. Each slot has its own build, though: pages holding addresses (the
+# vector table, literal pools, pointer tables) differ between the two even
+# when the code is the same.
+#
+#   ./flashdiff.py old.bin new.bin [running.bin]
+#                                     runs an incremental flash of new.bin
+#                                     over old.bin on an emulated flash, with
+#                                     running.bin in the other slot, and
+#                                     checks the result
+
+from __future__ import print_function
+
+import struct, sys, zlib
+
+BLOCK_SIZE = 64
+PAGE_SIZE = 2048
+FIRMWARE_SIZE = 0x801f000 - 0x8002000
+
+# Pages per 0x31 command, as many CRCs as fit in its reply
+CRC_BATCH = 15
+
+def crc32(data):
+	return zlib.crc32(bytes(data)) & 0xffffffff
+
+# SLOT_MARKER_* in arcin/bootslot.h, word aligned
+SLOT_MARKER = struct.pack('<II', 0x746f6c73, 0xc0f1e3ed)
+
+def has_slot_marker(data):
+	data = bytes(data)
+	pos = data.find(SLOT_MARKER)
+	while pos >= 0 and pos & 3:
+		pos = data.find(SLOT_MARKER, pos + 1)
+	return pos >= 0
+
+def pad_page(data):
+	return bytes(data) + b'\xff' * (-len(data) % PAGE_SIZE)
+
+def page_crcs(image):
+	# Past the end of the image, pages are whatever was there; compare only
+	# the pages the image covers
+	image = pad_page(image)
+	return [crc32(image[n:n + PAGE_SIZE]) for n in range(0, len(image), PAGE_SIZE)]
+
+# Runs of changed pages, as (first page, page count, copy). copy is true for
+# pages the running slot (running_crcs) already has at the same place. Never
+# the first page, whose vector table is linked for its slot.
+def changed_runs(image, device_crcs, running_crcs = []):
+	runs = []
+
+	for page, crc in enumerate(page_crcs(image)):
+		if page < len(device_crcs) and device_crcs[page] == crc:
+			continue
+
+		copy = page > 0 and page < len(running_crcs) and running_crcs[page] == crc
+
+		if runs and runs[-1][0] + runs[-1][1] == page and runs[-1][2] == copy:
+			runs[-1] = (runs[-1][0], runs[-1][1] + 1, copy)
+		else:
+			runs.append((page, 1, copy))
+
+	return runs
+
+# Blocks to send for a run, padded with erased flash (not zeros, so a
+# partially used last page compares equal next time)
+def run_blocks(image, run):
+	first, count = run[:2]
+	data = pad_page(image)[first * PAGE_SIZE:(first + count) * PAGE_SIZE]
+	return [data[n:n + BLOCK_SIZE] for n in range(0, len(data), BLOCK_SIZE)]
+
+# Drives a device through an incremental flash. dev needs page_crcs(first,
+# count, running), prepare(incremental), seek(page), copy_pages(first, count),
+# write_block(data), set_length(length) and finish().
+#
+# The bootloader takes the image length from the host, so the slot boots even
+# when no page changed, and whatever an older, longer image left past the end
+# doesn't count.
+def flash_incremental(dev, image):
+	pages = (len(image) + PAGE_SIZE - 1) // PAGE_SIZE
+
+	device_crcs = []
+	running_crcs = []
+	for first in range(0, pages, CRC_BATCH):
+		count = min(CRC_BATCH, pages - first)
+		device_crcs += dev.page_crcs(first, count, False)
+		running_crcs += dev.page_crcs(first, count, True)
+
+	runs = changed_runs(image, device_crcs, running_crcs)
+
+	dev.prepare(True)
+	for run in runs:
+		if run[2]:
+			dev.copy_pages(run[0], run[1])
+			continue
+
+		dev.seek(run[0])
+		for block in run_blocks(image, run):
+			dev.write_block(block)
+	dev.set_length(len(image))
+	dev.finish()
+
+	return runs
+
+# The bootloader's view of the slot being flashed, and of the running one
+# (read only), for testing without a device. Programming a halfword that isn't
+# erased fails, as on the real flash. finish() records the image length, CRC
+# and slot marker as the slot info would.
+class EmulatedFlash(object):
+	def __init__(self, contents = b'', running = b''):
+		self.flash = bytearray(b'\xff' * FIRMWARE_SIZE)
+		self.flash[:len(contents)] = bytearray(contents)
+		self.running = bytearray(b'\xff' * FIRMWARE_SIZE)
+		self.running[:len(running)] = bytearray(running)
+		self.erases = 0
+		self.copied = 0
+		self.addr = None
+		self.length = 0
+		self.crc = None
+		self.marker = False
+
+	def page_crcs(self, first, count, running = False):
+		flash = self.running if running else self.flash
+		return [crc32(flash[(first + n) * PAGE_SIZE:(first + n + 1) * PAGE_SIZE])
+			for n in range(count)]
+
+	def prepare(self, incremental = False):
+		self.addr = 0
+		self.erased_end = 0
+		self.incremental = incremental
+		self.length = 0
+		self.crc = None
+		self.marker = False
+		self.set_len = None
+
+	def seek(self, page):
+		self.addr = page * PAGE_SIZE
+		self.erased_end = self.addr
+		self.incremental = True
+
+	def copy_pages(self, first, count):
+		if first == 0:
+			raise RuntimeError('Copying the vector table of the other slot.')
+
+		self.seek(first)
+		for n in range(first * PAGE_SIZE, (first + count) * PAGE_SIZE, BLOCK_SIZE):
+			self.write_block(self.running[n:n + BLOCK_SIZE])
+		self.copied += count
+
+	def write_block(self, data):
+		if self.addr + len(data) > self.erased_end:
+			self.flash[self.erased_end:self.erased_end + PAGE_SIZE] = b'\xff' * PAGE_SIZE
+			self.erased_end += PAGE_SIZE
+			self.erases += 1
+
+		for n in range(0, len(data), 2):
+			if self.flash[self.addr + n:self.addr + n + 2] != b'\xff\xff':
+				raise RuntimeError('Programming a halfword that is not erased.')
+			self.flash[self.addr + n:self.addr + n + 2] = bytearray(data[n:n + 2])
+
+		self.addr += len(data)
+
+	def set_length(self, length):
+		if length & 3 or length < 8 or length > FIRMWARE_SIZE:
+			raise RuntimeError('Bad image length.')
+		self.set_len = length
+
+	def finish(self):
+		if self.incremental and self.set_len is None:
+			raise RuntimeError('Incremental flash without an image length.')
+
+		self.length = self.set_len or self.addr
+		self.crc = crc32(self.flash[:self.length])
+		self.marker = has_slot_marker(self.flash[:self.length])
+		self.addr = None
+
+	# Whether the bootloader would boot the slot (see check_slot())
+	def bootable(self):
+		return self.length >= 8 and self.crc == crc32(self.flash[:self.length])
+
+if __name__ == '__main__':
+	old = open(sys.argv[1], 'rb').read()
+	new = open(sys.argv[2], 'rb').read()
+	running = open(sys.argv[3], 'rb').read() if len(sys.argv) > 3 else b''
+
+	dev = EmulatedFlash(old, running)
+	runs = flash_incremental(dev, new)
+
+	if bytes(dev.flash[:len(new)]) != new:
+		raise RuntimeError('Emulated flash differs from the new image.')
+
+	if not dev.bootable():
+		raise RuntimeError('Emulated slot would not boot.')
+
+	written = sum(count for first, count, copy in runs if not copy)
+	total = (len(new) + PAGE_SIZE - 1) // PAGE_SIZE
+	print('%d of %d pages written, %d copied, %d erased: %s' % (
+		written, total, dev.copied, dev.erases,
+		', '.join('%d-%d%s' % (first, first + count - 1, ' (copied)' if copy else '')
+			for first, count, copy in runs)))
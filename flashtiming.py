@@ -0,0 +1,112 @@
+#!/usr/bin/env python
+
+# Timing model of flashing a firmware image through the HID bootloader, for
+# comparing the old synchronous write path with the queued one.
+#
+#   ./flashtiming.py [image size in bytes] [page erase ms] [ms per transfer]
+#
+# Defaults to a full 116k firmware area and a 30 ms page erase (STM32F303
+# datasheet: 20-40 ms erase, 53.5 us typ per halfword). Some hosts take
+# several ms per SET_REPORT.
+
+from __future__ import print_function
+
+import sys, math
+
+BLOCK_SIZE = 64
+PAGE_SIZE = 2048
+QUEUE_LEN = 8
+ERASE_AHEAD = 2
+
+# ms
+PROGRAM_HALFWORD = 0.0535
+WIRE = 0.15     # SET_REPORT setup, 64 byte data stage and status
+FRAME = 1.0     # the host starts at most one transfer per frame
+
+def next_frame(t):
+	return math.ceil(t / FRAME) * FRAME
+
+def block_program_time():
+	return (BLOCK_SIZE // 2) * PROGRAM_HALFWORD
+
+# Each block is erased (at page boundaries) and programmed before it is
+# acknowledged.
+def synchronous(size, erase):
+	t = 0.0
+
+	for addr in range(0, size, BLOCK_SIZE):
+		ack = t + WIRE
+
+		if not addr % PAGE_SIZE:
+			ack += erase
+
+		ack += block_program_time()
+		t = next_frame(ack)
+
+	return ack
+
+# Blocks are acknowledged once queued. The flash programs the queue in order,
+# and erases pages ahead whenever the queue is empty. The CPU (and so the
+# acknowledgement) stalls while a page erase is running.
+def queued(size, erase):
+	t = 0.0
+	flash_free = 0.0
+	erases = []          # (start, end) of each page erase
+	programmed = []      # program end time of each block
+	erased_end = 0
+	addr = 0
+
+	def erase_at(start):
+		erases.append((start, start + erase))
+		return start + erase
+
+	while addr < size:
+		arrival = t + WIRE
+
+		# Erase ahead while idle
+		while flash_free < arrival and erased_end < min(addr + ERASE_AHEAD * PAGE_SIZE, size):
+			flash_free = erase_at(flash_free)
+			erased_end += PAGE_SIZE
+
+		handle = arrival
+		for start, end in erases:
+			if start <= handle < end:
+				handle = end
+
+		# Queue full: wait for the oldest block to be programmed
+		pending = [end for end in programmed if end > handle]
+		if len(pending) >= QUEUE_LEN:
+			handle = pending[-QUEUE_LEN]
+
+		if addr + BLOCK_SIZE > erased_end:
+			flash_free = erase_at(max(flash_free, handle))
+			erased_end += PAGE_SIZE
+
+		flash_free = max(flash_free, handle) + block_program_time()
+		programmed.append(flash_free)
+
+		addr += BLOCK_SIZE
+		t = next_frame(handle)
+
+	# finish() waits for the queue to drain
+	return flash_free, t
+
+if __name__ == '__main__':
+	size = int(sys.argv[1]) if len(sys.argv) > 1 else 116 * 1024
+	erase = float(sys.argv[2]) if len(sys.argv) > 2 else 30.0
+	FRAME = float(sys.argv[3]) if len(sys.argv) > 3 else FRAME
+
+	floor = (size // 2) * PROGRAM_HALFWORD + (size // PAGE_SIZE) * erase
+
+	print('%d bytes, %d ms page erase, %.1f ms per transfer' % (size, erase, FRAME))
+
+	sync_ms = synchronous(size, erase)
+	queued_ms, queued_usb_ms = queued(size, erase)
+
+	for name, ms, usb_ms in (
+			('synchronous', sync_ms, sync_ms),
+			('queued', queued_ms, queued_usb_ms)):
+		print('%-12s %6.2f s  %5.1f kB/s  (transfers done at %.2f s)' % (
+			name, ms / 1000, size / 1024.0 / (ms / 1000), usb_ms / 1000))
+
+	print('%-12s %6.2f s  (flash operations only)' % ('lower bound', floor / 1000))
@@ -15,3 +15,26 @@ hidapi.hid_read.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t]
 hidapi.hid_write.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t]
 hidapi.hid_send_feature_report.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t]
 hidapi.hid_get_feature_report.argtypes = [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_size_t]
+
+class hid_device_info(ctypes.Structure):
+	pass
+
+hid_device_info._fields_ = [
+	('path', ctypes.c_char_p),
+	('vendor_id', ctypes.c_ushort),
+	('product_id', ctypes.c_ushort),
+	('serial_number', ctypes.c_wchar_p),
+	('release_number', ctypes.c_ushort),
+	('manufacturer_string', ctypes.c_wchar_p),
+	('product_string', ctypes.c_wchar_p),
+	('usage_page', ctypes.c_ushort),
+	('usage', ctypes.c_ushort),
+	('interface_number', ctypes.c_int),
+	('next', ctypes.POINTER(hid_device_info)),
+]
+
+hidapi.hid_enumerate.argtypes = [ctypes.c_ushort, ctypes.c_ushort]
+hidapi.hid_enumerate.restype = ctypes.POINTER(hid_device_info)
+hidapi.hid_free_enumeration.argtypes = [ctypes.POINTER(hid_device_info)]
+hidapi.hid_open_path.argtypes = [ctypes.c_char_p]
+hidapi.hid_open_path.restype = ctypes.c_void_p
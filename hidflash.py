@@ -1,34 +1,49 @@
 #!/usr/bin/env python
 
 from hidapi import hidapi
+import flashdiff
 from elftools.elf.elffile import ELFFile
 
-import ctypes, time, sys
+import ctypes, time, sys, struct, zlib
 
-e = ELFFile(open(sys.argv[1]))
+#   ./hidflash.py [--no-verify] arcin.elf
+#
+# Fails (after flashing) if the bootloader can't verify the written image,
+# unless --no-verify is given.
+args = [arg for arg in sys.argv[1:] if arg != '--no-verify']
+require_verify = len(args) == len(sys.argv) - 1
 
-buf = ''
+# Firmware slots (see arcin/bootslot.h); each has its own build of the
+# firmware, arcin.elf for A and arcin_b.elf for B.
+slot_bases = [0x8002000, 0x8020000]
 
-for segment in sorted(e.iter_segments(), key = lambda x: x.header.p_paddr):
-	if segment.header.p_type != 'PT_LOAD':
-		continue
+def load_image(path, base):
+	e = ELFFile(open(path))
 	
-	data = segment.data()
-	lma = segment.header.p_paddr
+	buf = ''
 	
-	# Workaround for LD aligning segments to a larger boundary than 8k.
-	if lma == 0x8000000:
-		lma += 0x2000
-		data = data[0x2000:]
+	for segment in sorted(e.iter_segments(), key = lambda x: x.header.p_paddr):
+		if segment.header.p_type != 'PT_LOAD':
+			continue
+		
+		data = segment.data()
+		lma = segment.header.p_paddr
+		
+		# Workaround for LD aligning segments to a larger boundary than 8k.
+		if lma < base:
+			data = data[base - lma:]
+			lma = base
+		
+		# Add padding if necessary.
+		buf += '\0' * (lma - base - len(buf))
+		
+		buf += data
 	
-	# Add padding if necessary.
-	buf += '\0' * (lma - 0x8002000 - len(buf))
+	# Align to 64B
+	if len(buf) & (64 - 1):
+		buf += '\0' * (64 - (len(buf) & (64 - 1)))
 	
-	buf += data
-
-# Align to 64B
-if len(buf) & (64 - 1):
-	buf += '\0' * (64 - (len(buf) & (64 - 1)))
+	return buf
 
 # Open device
 dev = hidapi.hid_open(0x1d50, 0x6084, None)
@@ -54,22 +69,157 @@ if not dev:
 	if not dev: 
 		raise RuntimeError('Device not found.')
 
-print 'Found bootloader device, starting flashing.'
+# The slot the bootloader flashes (the one it isn't booting). Older
+# bootloaders only have slot A.
+slot_buf = ctypes.create_string_buffer('\x00', 64)
+slot = 0
+if hidapi.hid_get_feature_report(dev, slot_buf, 64) >= 2:
+	slot = ord(slot_buf.raw[1])
+
+path = args[0]
+if slot == 1:
+	path = path[:-len('.elf')] + '_b.elf' if path.endswith('.elf') else path + '_b'
+
+print 'Found bootloader device, flashing %s to slot %s.' % (path, 'AB'[slot])
+
+image = load_image(path, slot_bases[slot])
+
+# Firmware that confirms its slot (SLOT_MARKER_* in arcin/bootslot.h) boots on
+# trial, and is rolled back if it fails to. Anything else boots as it is.
+if not flashdiff.has_slot_marker(image):
+	print 'WARNING: this image does not confirm its slot. It will boot without a'
+	print 'WARNING: trial, so it is not rolled back if it fails to start.'
+
+# Progress reports from the bootloader: state, error, queued, pages erased,
+# bytes received, bytes programmed, elapsed ms. Older bootloaders don't send
+# any.
+status_format = '<BBBBIII'
+status_buf = ctypes.create_string_buffer(64)
+status = None
+
+# Input reports marked 0x80 are command replies: command, word count, then
+# the data words
+def is_reply(n):
+	return n > 0 and ord(status_buf.raw[0]) == 0x80
+
+def read_status(timeout):
+	global status
+	while True:
+		n = hidapi.hid_read_timeout(dev, status_buf, 64, timeout)
+		if n < struct.calcsize(status_format):
+			return
+		if not is_reply(n):
+			status = struct.unpack_from(status_format, status_buf.raw)
+		timeout = 0
+
+# Commands (feature function 0x23, then an output report). Returns None if
+# the bootloader is too old to take commands.
+def command(cmd, *args):
+	global status
+	if hidapi.hid_send_feature_report(dev, ctypes.c_char_p('\x00\x23'), 2) != 2:
+		return None
+	
+	data = struct.pack('<B3x%dI' % len(args), cmd, *args).ljust(64, '\0')
+	if hidapi.hid_write(dev, ctypes.c_char_p('\x00' + data), 65) != 65:
+		raise RuntimeError('Command %02x failed.' % cmd)
+	
+	while True:
+		n = hidapi.hid_read_timeout(dev, status_buf, 64, 1000)
+		if n <= 0:
+			raise RuntimeError('No reply to command %02x.' % cmd)
+		if is_reply(n):
+			break
+		if n >= struct.calcsize(status_format):
+			status = struct.unpack_from(status_format, status_buf.raw)
+	
+	marker, reply_cmd, count = struct.unpack_from('<BBB', status_buf.raw)
+	if reply_cmd != cmd:
+		raise RuntimeError('Bad reply to command %02x.' % cmd)
+	
+	return list(struct.unpack_from('<%dI' % count, status_buf.raw, 4))
+
+# Only the pages that changed (command 0x31 to find them, 0x32 to skip ahead,
+# 0x33 for the image length), copying those the running slot has (0x34).
+# Bootloaders without 0x34 ignore the slot argument of 0x31; the running slot
+# then looks the same as the one being flashed, so nothing is copied.
+class Incremental(object):
+	def page_crcs(self, first, count, running):
+		return command(0x31, first, count, 1 if running else 0)
+	
+	def prepare(self, incremental):
+		function = '\x00\x24' if incremental else '\x00\x20'
+		if hidapi.hid_send_feature_report(dev, ctypes.c_char_p(function), 2) != 2:
+			raise RuntimeError('Prepare failed.')
+	
+	def seek(self, page):
+		command(0x32, page)
+	
+	def copy_pages(self, first, count):
+		command(0x34, first, count)
+	
+	def set_length(self, length):
+		command(0x33, length)
+	
+	def write_block(self, data):
+		if hidapi.hid_write(dev, ctypes.c_char_p('\x00' + data), 65) != 65:
+			raise RuntimeError('Writing failed.')
+	
+	def finish(self):
+		pass
+
+# Bootloaders that take commands can flash incrementally and verify
+commands = command(0x31, 0, 1) is not None
 
-# Prepare
-if hidapi.hid_send_feature_report(dev, ctypes.c_char_p('\x00\x20'), 2) != 2:
-	raise RuntimeError('Prepare failed.')
+# Prepare; incremental if the bootloader supports it
+if commands:
+	runs = flashdiff.flash_incremental(Incremental(), image)
+	print 'Wrote %d and copied %d of %d pages.' % (
+		sum(count for first, count, copy in runs if not copy),
+		sum(count for first, count, copy in runs if copy),
+		(len(image) + 2047) // 2048)
+	buf = ''
+
+else:
+	if hidapi.hid_send_feature_report(dev, ctypes.c_char_p('\x00\x20'), 2) != 2:
+		raise RuntimeError('Prepare failed.')
+	buf = image
 
 # Flash
+size = len(image)
 while buf:
 	if hidapi.hid_write(dev, ctypes.c_char_p('\x00' + buf[:64]), 65) != 65:
 		raise RuntimeError('Writing failed.')
 	buf = buf[64:]
+	
+	read_status(0)
+	if status and not (len(buf) & (8192 - 1)):
+		sys.stdout.write('\r%d / %d bytes' % (status[5], size))
+		sys.stdout.flush()
 
 # Finish
 if hidapi.hid_send_feature_report(dev, ctypes.c_char_p('\x00\x21'), 2) != 2:
 	raise RuntimeError('Finish failed.')
 
+read_status(100)
+if status:
+	state, error, queued, pages, received, programmed, elapsed_ms = status
+	print '\r%d bytes, %d pages erased, %.2f s, %.1f kB/s' % (
+		programmed, pages, elapsed_ms / 1000.0,
+		programmed / 1024.0 / max(elapsed_ms / 1000.0, 0.001))
+
+# Verify: the bootloader returns the CRC32 of a flash range (command 0x30)
+verified = False
+if commands:
+	crc, = command(0x30, slot_bases[slot] - 0x8000000, size)
+	if crc != zlib.crc32(image) & 0xffffffff:
+		raise RuntimeError('Verify failed: flash CRC %08x, expected %08x.' % (crc, zlib.crc32(image) & 0xffffffff))
+	print 'Verified, CRC %08x.' % crc
+	verified = True
+else:
+	print 'WARNING: this bootloader is too old to verify the written image.'
+	if require_verify:
+		print 'WARNING: update the bootloader, or pass --no-verify to accept this.'
+
 print 'Flashing finished, resetting to runtime.'
 
 # Reset
@@ -81,10 +231,13 @@ time.sleep(1)
 hidapi.hid_exit()
 
 if hidapi.hid_open(0x1d50, 0x6080, None):
-	print 'Done, everything ok.'
+	print 'Done, everything ok.' if verified else 'Done, NOT verified.'
 	
 elif hidapi.hid_open(0x1d50, 0x6084, None):
 	print 'Still in bootloader mode.'
 
 else:
 	print 'Device disappeared.'
+
+if not verified and require_verify:
+	sys.exit(1)
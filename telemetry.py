@@ -0,0 +1,75 @@
+#!/usr/bin/env python
+
+from hidapi import hidapi
+
+import ctypes, sys, struct
+
+#   ./telemetry.py [seconds]
+#
+# Streams telemetry (see arcin/telemetry.h) for a few seconds and prints the
+# main loop rate: iterations per millisecond and the longest iteration.
+
+seconds = int(sys.argv[1]) if len(sys.argv) > 1 else 5
+
+# The telemetry interface; left out in single-interface mode.
+telemetry_interface = 2
+
+def open_telemetry():
+	info = hidapi.hid_enumerate(0x1d50, 0x6080)
+	dev = None
+	
+	node = info
+	while node:
+		if node.contents.interface_number == telemetry_interface:
+			dev = hidapi.hid_open_path(node.contents.path)
+			break
+		node = node.contents.next
+	
+	hidapi.hid_free_enumeration(info)
+	return dev
+
+def enable(dev, on):
+	if hidapi.hid_send_feature_report(dev, ctypes.c_char_p('\x02' + chr(on)), 2) != 2:
+		raise RuntimeError('Enabling telemetry failed.')
+
+dev = open_telemetry()
+
+if not dev:
+	raise RuntimeError('Telemetry interface not found.')
+
+enable(dev, 1)
+
+counts = []
+loop_max_us = 0
+dropped = 0
+buf = ctypes.create_string_buffer(64)
+
+try:
+	while len(counts) < seconds * 1000:
+		n = hidapi.hid_read_timeout(dev, buf, 64, 1000)
+		if n < 18:
+			raise RuntimeError('Reading telemetry failed.')
+		
+		report_id, sequence, drop, gamepad_reports, time_ms, loop_count, loop_time_max_us = \
+			struct.unpack('<BBBBIIH', buf.raw[:18])
+		
+		if report_id != 0x01:
+			continue
+		
+		# The first millisecond starts partway through.
+		if sequence == 0:
+			continue
+		
+		counts.append(loop_count)
+		loop_max_us = max(loop_max_us, loop_time_max_us)
+		dropped += drop
+finally:
+	enable(dev, 0)
+
+counts.sort()
+
+print 'Loop iterations per ms over %d ms:' % len(counts)
+print '  min %d, median %d, mean %.1f, max %d' % (
+	counts[0], counts[len(counts) / 2], float(sum(counts)) / len(counts), counts[-1])
+print 'Longest iteration: %d us' % loop_max_us
+print 'Reports dropped by the firmware: %d' % dropped
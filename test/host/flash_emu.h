@@ -0,0 +1,258 @@
+#ifndef HOST_FLASH_EMU_H
+#define HOST_FLASH_EMU_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "test.h"
+
+// Emulated STM32F303 flash for host tests, mapped at the device address so
+// that code taking flash addresses as uint32_t works unchanged.
+//
+// Like the real flash, it only programs erased halfwords (anything else is
+// a test failure), a page erase or a halfword program keeps BSY set for its
+// datasheet time, and the CPU can carry on meanwhile (unlike the real flash,
+// which stalls instruction fetches). Time is virtual; tests advance it.
+//
+// Programming is a plain store, so the emulator can't see it happen. step()
+// compares the watched range before and after to check and count it.
+namespace flash_emu {
+    static const uint32_t BASE = 0x8000000;
+    static const uint32_t SIZE = 256 * 1024;
+    static const uint32_t PAGE_SIZE = 2048;
+
+    // STM32F303 datasheet: 20-40 ms page erase, 53.5 us typ per halfword
+    static const uint32_t ERASE_US = 30000;
+    static const uint32_t PROGRAM_US = 54;
+
+    static uint8_t* mem;
+    static uint64_t now_us;
+    static uint64_t busy_until;
+
+    static bool locked = true;
+    static uint32_t cr;
+    static uint32_t ar;
+    static uint32_t sr_flags;
+
+    // operation in progress, for power_loss()
+    static bool erasing;
+    static bool programming;
+    static uint32_t last_programmed;
+
+    // wear and activity
+    static uint32_t page_erases[SIZE / PAGE_SIZE];
+    static uint32_t halfwords_programmed;
+
+    // range checked by step()
+    static uint32_t watch_addr;
+    static uint32_t watch_len;
+    static uint8_t* watch_before;
+
+    static uint8_t* at(uint32_t addr) {
+        return mem + (addr - BASE);
+    }
+
+    static bool busy() {
+        return now_us < busy_until;
+    }
+
+    // Fresh, fully erased flash; watches the given range
+    static void reset(uint32_t addr, uint32_t len) {
+        if (!mem) {
+            void* p = mmap((void*)(uintptr_t)BASE, SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+            CHECK(p == (void*)(uintptr_t)BASE);
+            mem = (uint8_t*)p;
+        }
+
+        memset(mem, 0xff, SIZE);
+        memset(page_erases, 0, sizeof(page_erases));
+        now_us = 0;
+        busy_until = 0;
+        locked = true;
+        cr = 0;
+        sr_flags = 0;
+        erasing = false;
+        programming = false;
+        halfwords_programmed = 0;
+
+        free(watch_before);
+        watch_addr = addr;
+        watch_len = len;
+        watch_before = (uint8_t*)malloc(len);
+    }
+
+    static void write_cr(uint32_t value) {
+        if (value & (1 << 7)) { // LOCK
+            locked = true;
+        }
+
+        if (!locked && (value & (1 << 6)) && (value & (1 << 1))) { // STRT, PER
+            CHECK(!busy());
+            CHECK(ar >= BASE && ar < BASE + SIZE);
+
+            uint32_t page = (ar - BASE) / PAGE_SIZE;
+            memset(at(BASE + page * PAGE_SIZE), 0xff, PAGE_SIZE);
+            page_erases[page] += 1;
+
+            erasing = true;
+            busy_until = now_us + ERASE_US;
+        }
+
+        cr = value;
+    }
+
+    // Runs fn() (which may program at most one halfword, with PG set, into
+    // the watched range) and checks what it programmed.
+    template <typename F>
+    static void step(F fn) {
+        memcpy(watch_before, at(watch_addr), watch_len);
+        uint32_t erases_before = 0;
+        for (uint32_t n = 0; n < SIZE / PAGE_SIZE; n++) {
+            erases_before += page_erases[n];
+        }
+
+        fn();
+
+        uint32_t erases_after = 0;
+        for (uint32_t n = 0; n < SIZE / PAGE_SIZE; n++) {
+            erases_after += page_erases[n];
+        }
+
+        // An erase changes a whole page; nothing else happened then
+        if (erases_after != erases_before ||
+            memcmp(watch_before, at(watch_addr), watch_len) == 0) {
+            return;
+        }
+
+        uint32_t changed = 0;
+        for (uint32_t n = 0; n < watch_len; n += 2) {
+            uint16_t before = *(uint16_t*)(watch_before + n);
+            uint16_t after = *(uint16_t*)(at(watch_addr) + n);
+
+            if (before == after) {
+                continue;
+            }
+
+            // Only erased halfwords can be programmed (or anything to 0)
+            CHECK(!locked && (cr & (1 << 0))); // PG
+            CHECK(!busy());
+            CHECK(before == 0xffff || after == 0);
+
+            last_programmed = watch_addr + n;
+            changed += 1;
+        }
+
+        CHECK(changed <= 1);
+
+        if (changed) {
+            halfwords_programmed += 1;
+            programming = true;
+            erasing = false;
+            busy_until = now_us + PROGRAM_US;
+        }
+    }
+
+    static void advance(uint32_t us) {
+        now_us += us;
+
+        if (!busy()) {
+            erasing = false;
+            programming = false;
+        }
+    }
+
+    // Power cut now: an operation in progress leaves its target undefined
+    static void power_loss() {
+        if (busy() && erasing) {
+            uint8_t* page = at(ar & ~(PAGE_SIZE - 1));
+            for (uint32_t n = 0; n < PAGE_SIZE; n++) {
+                page[n] &= rand();
+            }
+        }
+
+        if (busy() && programming) {
+            // Some bits that should have been cleared still set
+            *(uint16_t*)at(last_programmed) |= rand();
+        }
+
+        busy_until = now_us;
+        erasing = false;
+        programming = false;
+        locked = true;
+        cr = 0;
+        sr_flags = 0;
+    }
+
+    static uint32_t total_erases() {
+        uint32_t total = 0;
+        for (uint32_t n = 0; n < SIZE / PAGE_SIZE; n++) {
+            total += page_erases[n];
+        }
+        return total;
+    }
+}
+
+struct flash_keyr_t {
+    uint32_t last;
+
+    flash_keyr_t& operator=(uint32_t value) {
+        if (last == 0x45670123 && value == 0xCDEF89AB) {
+            flash_emu::locked = false;
+        }
+        last = value;
+        return *this;
+    }
+};
+
+struct flash_cr_t {
+    flash_cr_t& operator=(uint32_t value) {
+        flash_emu::write_cr(value);
+        return *this;
+    }
+
+    operator uint32_t() const {
+        return flash_emu::cr;
+    }
+};
+
+struct flash_ar_t {
+    flash_ar_t& operator=(uint32_t value) {
+        flash_emu::ar = value;
+        return *this;
+    }
+
+    operator uint32_t() const {
+        return flash_emu::ar;
+    }
+};
+
+// BSY (bit 0) follows the operation in progress; EOP (bit 5) is set when it
+// finishes. PGERR and WRPRTERR never happen, step() fails the test instead.
+struct flash_sr_t {
+    operator uint32_t() const {
+        return (flash_emu::busy() ? (1 << 0) : (1 << 5)) | flash_emu::sr_flags;
+    }
+
+    // Error and EOP flags are cleared by writing 1
+    flash_sr_t& operator=(uint32_t value) {
+        flash_emu::sr_flags &= ~value;
+        return *this;
+    }
+
+    flash_sr_t& operator&=(uint32_t value) {
+        return *this;
+    }
+};
+
+struct FLASH_t {
+    flash_keyr_t KEYR;
+    flash_cr_t CR;
+    flash_ar_t AR;
+    flash_sr_t SR;
+};
+
+static FLASH_t FLASH __attribute__((unused));
+
+#endif
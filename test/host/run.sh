@@ -0,0 +1,36 @@
+#!/bin/sh
+
+# Host tests: builds each test_*.cpp against the headers in arcin/ (with the
+# laks headers they need stubbed in stub/) and runs it, then runs the Python
+# tests for the flashing tools.
+#
+#   test/host/run.sh
+
+set -e
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(cd "$HERE/../.." && pwd)
+OUT=${TMPDIR:-/tmp}/arcin-host-test
+
+CXX=${CXX:-g++}
+PYTHON=${PYTHON:-python3}
+
+mkdir -p "$OUT"
+
+for test in "$HERE"/test_*.cpp; do
+    name=$(basename "$test" .cpp)
+    echo "$name"
+    $CXX -std=gnu++11 -O1 -g -Wall -Wno-unused-function -Wno-int-to-pointer-cast \
+        -DCRC32_SOFTWARE \
+        -I"$HERE/stub" -I"$ROOT/arcin" -I"$HERE" \
+        "$test" -o "$OUT/$name"
+    "$OUT/$name"
+done
+
+for test in "$HERE"/test_*.py; do
+    [ -e "$test" ] || continue
+    echo "$(basename "$test" .py)"
+    (cd "$ROOT" && $PYTHON "$test")
+done
+
+echo "All host tests passed."
@@ -0,0 +1,19 @@
+#ifndef HOST_STUB_TIME_H
+#define HOST_STUB_TIME_H
+
+#include <stdint.h>
+
+// Host stand-in for laks' os/time.h: a clock the tests advance by hand.
+namespace Time {
+    static uint32_t host_now;
+
+    static inline uint32_t time() {
+        return host_now;
+    }
+
+    static inline void sleep(uint32_t ms) {
+        host_now += ms;
+    }
+}
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef HOST_STUB_FLASH_H
+#define HOST_STUB_FLASH_H
+
+// Host stand-in for laks' rcc/flash.h: the registers of the emulated flash
+// in flash_emu.h.
+#include "flash_emu.h"
+
+#endif
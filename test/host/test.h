@@ -0,0 +1,33 @@
+#ifndef HOST_TEST_H
+#define HOST_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Minimal checks for the host tests; the first failure ends the test program.
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+#define CHECK_EQ(a, b) \
+    do { \
+        long long check_a = (long long)(a); \
+        long long check_b = (long long)(b); \
+        if (check_a != check_b) { \
+            fprintf(stderr, "%s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n", \
+                __FILE__, __LINE__, #a, #b, check_a, check_b); \
+            exit(1); \
+        } \
+    } while (0)
+
+#define RUN(test) \
+    do { \
+        test(); \
+        printf("  %s\n", #test); \
+    } while (0)
+
+#endif
@@ -0,0 +1,267 @@
+#include "test.h"
+#include "flash_emu.h"
+#include "bootslot.h"
+
+// The bootloader's choice of slot (bootslot.h), with the slots and their
+// info pages in the emulated flash.
+
+static const uint32_t IMAGE_LEN = 3000;
+
+// An image linked for the slot, as the bootloader writes it
+static void write_image(uint32_t slot, uint8_t seed) {
+    const boot_slot_t& bounds = boot_slots[slot];
+    uint32_t* image = (uint32_t*)flash_emu::at(bounds.start);
+
+    image[0] = 0x20000000 + 0xa000; // initial SP
+    image[1] = bounds.start + 0x101; // reset vector, thumb
+    for (uint32_t n = 2; n < IMAGE_LEN / 4; n++) {
+        image[n] = n * 0x9e3779b9 + seed;
+    }
+}
+
+static void write_info(uint32_t slot, uint32_t sequence) {
+    slot_info_t* info = (slot_info_t*)flash_emu::at(boot_slots[slot].info);
+
+    info->started = SLOT_STARTED;
+    info->length = IMAGE_LEN;
+    info->crc = crc32((void*)boot_slots[slot].start, IMAGE_LEN);
+    info->sequence = sequence;
+    info->complete = SLOT_COMPLETE;
+}
+
+static slot_info_t* info(uint32_t slot) {
+    return (slot_info_t*)flash_emu::at(boot_slots[slot].info);
+}
+
+static slot_check_t check(uint32_t slot) {
+    uint32_t sequence;
+    return check_slot(slot, &sequence);
+}
+
+static uint32_t sequence(uint32_t slot) {
+    uint32_t sequence;
+    check_slot(slot, &sequence);
+    return sequence;
+}
+
+static void fresh_flash() {
+    flash_emu::reset(boot_slots[0].start, 2048);
+}
+
+static void test_empty() {
+    fresh_flash();
+
+    CHECK_EQ(check(0), SLOT_EMPTY);
+    CHECK_EQ(check(1), SLOT_EMPTY);
+    CHECK_EQ(select_slot(), -1);
+}
+
+static void test_valid() {
+    for (uint32_t slot = 0; slot < SLOT_COUNT; slot++) {
+        fresh_flash();
+        write_image(slot, 1);
+        write_info(slot, 5);
+
+        CHECK_EQ(check(slot), SLOT_OK);
+        CHECK_EQ(sequence(slot), 5);
+        CHECK_EQ(select_slot(), (int)slot);
+    }
+}
+
+// An image linked for the other slot doesn't run from this one
+static void test_wrong_slot() {
+    fresh_flash();
+    write_image(1, 1);
+    write_info(1, 1);
+    ((uint32_t*)flash_emu::at(boot_slots[1].start))[1] = boot_slots[0].start + 0x101;
+
+    CHECK_EQ(check(1), SLOT_EMPTY);
+    CHECK_EQ(select_slot(), -1);
+}
+
+// No image info: slot A as flashed by bootloaders from before image info,
+// and slot B never flashed
+static void test_missing_info() {
+    fresh_flash();
+    write_image(0, 1);
+    write_image(1, 2);
+
+    CHECK_EQ(check(0), SLOT_OK);
+    CHECK_EQ(sequence(0), 0);
+    CHECK_EQ(check(1), SLOT_EMPTY);
+    CHECK_EQ(select_slot(), 0);
+}
+
+// Image info from bootloaders without sequence numbers or trials
+static void test_legacy_info() {
+    fresh_flash();
+    write_image(0, 1);
+    write_info(0, 0xffffffff);
+
+    CHECK_EQ(check(0), SLOT_OK);
+    CHECK_EQ(sequence(0), 0);
+
+    // Any newer image wins over it
+    write_image(1, 2);
+    write_info(1, 1);
+    CHECK_EQ(select_slot(), 1);
+}
+
+// Flashing cut short at each stage leaves the other slot in charge
+static void test_torn() {
+    for (uint32_t stage = 0; stage < 5; stage++) {
+        fresh_flash();
+        write_image(0, 1);
+        write_info(0, 3);
+
+        write_image(1, 2);
+        write_info(1, 4);
+        slot_info_t* torn = info(1);
+
+        switch (stage) {
+            case 0: // Image partly written
+                ((uint32_t*)flash_emu::at(boot_slots[1].start))[IMAGE_LEN / 8] = 0xffffffff;
+                CHECK_EQ(check(1), SLOT_BAD_CRC);
+                break;
+
+            case 1: // Info page erased, started not yet programmed
+                memset(torn, 0xff, sizeof(*torn));
+                CHECK_EQ(check(1), SLOT_EMPTY);
+                break;
+
+            case 2: // Started, nothing else
+                torn->length = 0xffffffff;
+                torn->crc = 0xffffffff;
+                torn->sequence = 0xffffffff;
+                torn->complete = 0xffffffff;
+                CHECK_EQ(check(1), SLOT_INCOMPLETE);
+                break;
+
+            case 3: // Half of the CRC programmed
+                torn->crc |= 0xffff0000;
+                torn->sequence = 0xffffffff;
+                torn->complete = 0xffffffff;
+                CHECK(check(1) != SLOT_OK);
+                break;
+
+            case 4: // Everything but complete
+                torn->complete = 0xffffffff;
+                CHECK_EQ(check(1), SLOT_INCOMPLETE);
+                break;
+        }
+
+        CHECK_EQ(select_slot(), 0);
+    }
+}
+
+// A length the slot can't hold isn't trusted, whatever the CRC says
+static void test_bad_length() {
+    fresh_flash();
+    write_image(1, 1);
+    write_info(1, 1);
+    info(1)->length = 4;
+
+    CHECK_EQ(check(1), SLOT_INCOMPLETE);
+
+    info(1)->length = boot_slots[1].end - boot_slots[1].start + 4;
+    CHECK_EQ(check(1), SLOT_INCOMPLETE);
+}
+
+// Tried on every trial boot but never confirmed: rolled back to the other
+// slot. Until then (a power loss, say) it gets another trial.
+static void test_trial() {
+    fresh_flash();
+    write_image(0, 1);
+    write_info(0, 1);
+    write_image(1, 2);
+    write_info(1, 2);
+
+    CHECK_EQ(select_slot(), 1);
+
+    for (uint32_t trial = 0; trial < SLOT_TRIAL_ATTEMPTS; trial++) {
+        CHECK_EQ(check(1), SLOT_OK);
+        CHECK_EQ(select_slot(), 1);
+
+        const uint16_t* flag = slot_next_trial(info(1));
+        CHECK(flag == (trial == 0 ? &info(1)->tried : &info(1)->retried[trial - 1]));
+        *(uint16_t*)flag = SLOT_FLAG_SET;
+    }
+
+    CHECK(slot_next_trial(info(1)) == nullptr);
+    CHECK_EQ(check(1), SLOT_FAILED);
+    CHECK_EQ(select_slot(), 0);
+
+    info(1)->confirmed = SLOT_FLAG_SET;
+    CHECK_EQ(check(1), SLOT_OK);
+    CHECK_EQ(select_slot(), 1);
+
+    // Confirmed without a trial (booted before the trial was marked)
+    info(1)->tried = 0xffff;
+    for (uint32_t n = 0; n < SLOT_TRIAL_ATTEMPTS - 1; n++) {
+        info(1)->retried[n] = 0xffff;
+    }
+    CHECK_EQ(select_slot(), 1);
+}
+
+// The newest of two good slots, whichever it is
+static void test_sequence() {
+    const uint32_t sequences[][2] = {
+        {1, 2}, {2, 1}, {7, 6}, {0, 1}, {0xfffffffe, 3},
+    };
+
+    for (const uint32_t* s : sequences) {
+        fresh_flash();
+        write_image(0, 1);
+        write_info(0, s[0]);
+        write_image(1, 2);
+        write_info(1, s[1]);
+
+        CHECK_EQ(select_slot(), s[0] > s[1] ? 0 : 1);
+    }
+}
+
+// The slot marker, wherever the firmware's linker put it
+static void test_marker() {
+    fresh_flash();
+    write_image(1, 1);
+
+    uint32_t start = boot_slots[1].start;
+    uint32_t* image = (uint32_t*)flash_emu::at(start);
+
+    CHECK(!image_confirms_slot(start, IMAGE_LEN));
+
+    const uint32_t offsets[] = {0, 8, 100, IMAGE_LEN / 4 - 2};
+    for (uint32_t offset : offsets) {
+        write_image(1, 1);
+        image[offset] = SLOT_MARKER_0;
+        image[offset + 1] = SLOT_MARKER_1;
+
+        CHECK(image_confirms_slot(start, IMAGE_LEN));
+
+        // Not if it's past the end of the image
+        CHECK_EQ(image_confirms_slot(start, offset * 4 + 4), false);
+    }
+
+    // Both words, in order
+    write_image(1, 1);
+    image[10] = SLOT_MARKER_1;
+    image[11] = SLOT_MARKER_0;
+    image[20] = SLOT_MARKER_0;
+    CHECK(!image_confirms_slot(start, IMAGE_LEN));
+}
+
+int main() {
+    crc32_init();
+
+    RUN(test_empty);
+    RUN(test_valid);
+    RUN(test_wrong_slot);
+    RUN(test_missing_info);
+    RUN(test_legacy_info);
+    RUN(test_torn);
+    RUN(test_bad_length);
+    RUN(test_trial);
+    RUN(test_sequence);
+    RUN(test_marker);
+    return 0;
+}
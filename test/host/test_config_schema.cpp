@@ -0,0 +1,177 @@
+#include "test.h"
+#include "config_schema.h"
+
+// config_encode() / config_decode(), and decoding the layouts saved by older
+// firmware
+
+static config_t make_config(uint8_t seed) {
+    config_t config;
+    uint8_t* bytes = (uint8_t*)&config;
+    for (uint32_t n = 0; n < sizeof(config); n++) {
+        bytes[n] = seed + n * 3;
+    }
+    return config;
+}
+
+// A single config from before profiles: every profile starts out as it
+static void test_legacy_single_config() {
+    config_t legacy = make_config(5);
+
+    // As saved by the oldest firmware (the legacy segment) and by later
+    // firmware before profiles (the whole config_t)
+    const uint32_t sizes[] = {CONFIG_SEGMENT_SIZE, sizeof(config_t)};
+
+    for (uint32_t len : sizes) {
+        uint8_t data[sizeof(config_t)];
+        memcpy(data, &legacy, len);
+
+        config_store_t store;
+        config_decode(data, len, store);
+
+        CHECK_EQ(store.active_profile, 0);
+
+        for (uint8_t index = 0; index < CONFIG_PROFILE_COUNT; index++) {
+            CHECK(memcmp(&store.profiles[index], &legacy, len) == 0);
+            CHECK(config_is_zero((uint8_t*)&store.profiles[index] + len, sizeof(config_t) - len));
+        }
+    }
+}
+
+// A config_store_t saved before the schema: profiles as they were
+static void test_legacy_store() {
+    config_store_t legacy;
+    memset(&legacy, 0, sizeof(legacy));
+    for (uint8_t index = 0; index < CONFIG_PROFILE_COUNT; index++) {
+        legacy.profiles[index] = make_config(index * 50);
+    }
+    legacy.active_profile = 2;
+
+    config_store_t store;
+    config_decode((const uint8_t*)&legacy, sizeof(legacy), store);
+
+    CHECK(memcmp(&store, &legacy, sizeof(store)) == 0);
+}
+
+// Nothing saved yet
+static void test_empty() {
+    uint8_t data[4] = {0xff, 0xff, 0xff, 0xff};
+    config_store_t store;
+    config_decode(data, 0, store);
+
+    CHECK(config_is_zero((const uint8_t*)&store, sizeof(store)));
+}
+
+static config_store_t make_store(uint8_t seed) {
+    config_store_t store;
+    memset(&store, 0, sizeof(store));
+    for (uint8_t index = 0; index < CONFIG_PROFILE_COUNT; index++) {
+        store.profiles[index] = make_config(seed + index * 50);
+    }
+    store.active_profile = seed % CONFIG_PROFILE_COUNT;
+    return store;
+}
+
+// Every byte of config_t belongs to a field, so nothing is lost in a save
+static void test_fields_cover_config() {
+    uint8_t covered[sizeof(config_t)] = {0};
+
+    for (uint32_t f = 0; f < CONFIG_FIELD_COUNT; f++) {
+        CHECK(config_find_field(config_fields[f].tag) == &config_fields[f]);
+
+        for (uint32_t n = 0; n < config_fields[f].size; n++) {
+            covered[config_fields[f].offset + n] += 1;
+        }
+    }
+
+    // Padding at the end of config_t aside
+    uint32_t end = offsetof(config_t, tt_accel_curve) + sizeof(config_t::tt_accel_curve);
+    for (uint32_t n = 0; n < sizeof(config_t); n++) {
+        CHECK_EQ(covered[n], n < end ? 1 : 0);
+    }
+}
+
+static void check_round_trip(const config_store_t& store) {
+    uint8_t data[CONFIG_ENCODED_MAX];
+    uint32_t len = config_encode(store, data);
+    CHECK(len <= sizeof(data));
+
+    // Older firmware reads the active profile from the prefix
+    CHECK(memcmp(data, &store.profiles[store.active_profile], CONFIG_SEGMENT_SIZE) == 0);
+
+    config_store_t decoded;
+    config_decode(data, len, decoded);
+
+    for (uint8_t index = 0; index < CONFIG_PROFILE_COUNT; index++) {
+        CHECK(memcmp(&decoded.profiles[index], &store.profiles[index],
+            offsetof(config_t, tt_accel_curve) + sizeof(config_t::tt_accel_curve)) == 0);
+    }
+    CHECK_EQ(decoded.active_profile, store.active_profile);
+}
+
+// Arbitrary stores, including every field at its largest
+static void test_round_trip() {
+    for (uint8_t seed = 0; seed < 50; seed++) {
+        check_round_trip(make_store(seed));
+    }
+
+    config_store_t store;
+    memset(&store, 0xff, sizeof(store));
+    store.active_profile = CONFIG_PROFILE_COUNT - 1;
+    check_round_trip(store);
+
+    memset(&store, 0, sizeof(store));
+    check_round_trip(store);
+}
+
+// Legacy configs, decoded then saved in the new layout, read back the same
+static void test_legacy_round_trip() {
+    for (uint8_t seed = 0; seed < 20; seed++) {
+        config_t legacy = make_config(seed);
+        config_store_t store;
+
+        config_decode((const uint8_t*)&legacy, CONFIG_SEGMENT_SIZE, store);
+        check_round_trip(store);
+
+        config_decode((const uint8_t*)&legacy, sizeof(legacy), store);
+        check_round_trip(store);
+
+        config_store_t legacy_store = make_store(seed);
+        config_decode((const uint8_t*)&legacy_store, sizeof(legacy_store), store);
+        check_round_trip(store);
+    }
+}
+
+// What newer firmware might save: unknown tags are skipped, shorter values
+// zero-extended and longer ones truncated
+static void test_newer_schema() {
+    config_store_t store = make_store(7);
+    store.active_profile = 0;
+
+    uint8_t data[CONFIG_ENCODED_MAX + 64];
+    uint32_t len = config_encode(store, data);
+
+    uint8_t unknown[] = {1, 2, 3, 4, 5};
+    uint8_t* p = data + len;
+    p = config_put_entry(p, 0x7e, unknown, sizeof(unknown));
+    p = config_put_entry(p, 0x03, unknown, 0); // qe1_sens, empty
+    p = config_put_entry(p, 0x0a, unknown, 5); // tt_accel_curve, longer
+
+    config_store_t decoded;
+    config_decode(data, p - data, decoded);
+
+    const config_t& profile = decoded.profiles[CONFIG_PROFILE_COUNT - 1];
+    CHECK_EQ(profile.qe1_sens, 0);
+    CHECK(memcmp(profile.tt_accel_curve, unknown, sizeof(profile.tt_accel_curve)) == 0);
+    CHECK_EQ(profile.qe2_sens, store.profiles[CONFIG_PROFILE_COUNT - 1].qe2_sens);
+}
+
+int main() {
+    RUN(test_legacy_single_config);
+    RUN(test_legacy_store);
+    RUN(test_empty);
+    RUN(test_fields_cover_config);
+    RUN(test_round_trip);
+    RUN(test_legacy_round_trip);
+    RUN(test_newer_schema);
+    return 0;
+}
@@ -0,0 +1,428 @@
+#include "test.h"
+#include "flash_emu.h"
+#include "configloader.h"
+
+// configloader.h against the emulated flash, at the same pages as main.cpp.
+// The main loop is modelled as one poll() every LOOP_US.
+
+static const uint32_t PAGE_A = 0x801f000;
+static const uint32_t PAGE_B = 0x801f800;
+static const uint32_t LOOP_US = 10;
+
+// Arbitrary; the journal takes any record that fits a page
+static const uint32_t CONFIG_SIZE = 64;
+
+struct test_config_t {
+    uint8_t bytes[CONFIG_SIZE];
+};
+
+static test_config_t make_config(uint32_t n) {
+    test_config_t config;
+    for (uint32_t i = 0; i < CONFIG_SIZE; i++) {
+        config.bytes[i] = n * 7 + i;
+    }
+    return config;
+}
+
+static void fresh_flash() {
+    flash_emu::reset(PAGE_A, 2 * flash_emu::PAGE_SIZE);
+}
+
+// One main loop iteration
+static void loop_once(Configloader& loader, uint32_t us = LOOP_US) {
+    flash_emu::step([&]() { loader.poll(); });
+    flash_emu::advance(us);
+}
+
+// Saves and polls until done, erasing as soon as the save waits for it;
+// returns the time taken in us
+static uint64_t save(Configloader& loader, const test_config_t& config) {
+    uint64_t start = flash_emu::now_us;
+
+    CHECK(loader.write(sizeof(config), &config));
+    while (loader.busy()) {
+        if (loader.waiting()) {
+            CHECK(loader.erase_spare());
+        }
+        loop_once(loader);
+    }
+    CHECK_EQ(loader.get_result(), 1);
+
+    return flash_emu::now_us - start;
+}
+
+static bool read_back(const test_config_t& expected) {
+    Configloader loader(PAGE_A, PAGE_B);
+    test_config_t config;
+
+    if (loader.read(sizeof(config), &config) != sizeof(config)) {
+        return false;
+    }
+    return memcmp(&config, &expected, sizeof(config)) == 0;
+}
+
+// A save into the erased remainder of a page only programs halfwords, one
+// per poll; only a save that fills the page pays for an erase. Either way
+// poll() never waits on the flash.
+static void test_save_latency() {
+    fresh_flash();
+    Configloader loader(PAGE_A, PAGE_B);
+
+    // header, data, trailer
+    const uint32_t halfwords = (8 + CONFIG_SIZE + 8) / 2;
+    const uint64_t program_time = halfwords * (flash_emu::PROGRAM_US + LOOP_US);
+
+    uint64_t worst_append = 0;
+    uint64_t worst_erase = 0;
+
+    for (uint32_t n = 0; n < 100; n++) {
+        uint32_t erases = loader.erase_count;
+        uint32_t programmed = flash_emu::halfwords_programmed;
+
+        test_config_t config = make_config(n);
+        uint64_t took = save(loader, config);
+
+        CHECK_EQ(flash_emu::halfwords_programmed - programmed, halfwords);
+        CHECK(loader.erase_count - erases <= 1);
+
+        if (loader.erase_count != erases) {
+            worst_erase = took > worst_erase ? took : worst_erase;
+        } else {
+            worst_append = took > worst_append ? took : worst_append;
+        }
+
+        CHECK(read_back(config));
+    }
+
+    CHECK(worst_append <= program_time + 2 * LOOP_US);
+    CHECK(worst_erase <= flash_emu::ERASE_US + program_time + 3 * LOOP_US);
+
+    printf("    save: %u halfwords, %llu us appending, %llu us with an erase\n",
+        halfwords, (unsigned long long)worst_append, (unsigned long long)worst_erase);
+}
+
+// Saving what is already stored touches nothing
+static void test_unchanged_save_is_free() {
+    fresh_flash();
+    Configloader loader(PAGE_A, PAGE_B);
+
+    test_config_t config = make_config(1);
+    save(loader, config);
+
+    uint32_t programmed = flash_emu::halfwords_programmed;
+    uint32_t erases = flash_emu::total_erases();
+
+    save(loader, config);
+
+    CHECK_EQ(flash_emu::halfwords_programmed, programmed);
+    CHECK_EQ(flash_emu::total_erases(), erases);
+}
+
+// Each page is only erased once the other one has filled up, so wear is
+// spread over as many saves as fit in a page, alternating between pages.
+static void test_wear() {
+    fresh_flash();
+    Configloader loader(PAGE_A, PAGE_B);
+
+    const uint32_t saves = 10000;
+    const uint32_t per_page = flash_emu::PAGE_SIZE / (8 + CONFIG_SIZE + 8);
+
+    for (uint32_t n = 0; n < saves; n++) {
+        save(loader, make_config(n));
+    }
+
+    uint32_t erases_a = flash_emu::page_erases[(PAGE_A - flash_emu::BASE) / flash_emu::PAGE_SIZE];
+    uint32_t erases_b = flash_emu::page_erases[(PAGE_B - flash_emu::BASE) / flash_emu::PAGE_SIZE];
+
+    CHECK_EQ(erases_a + erases_b, loader.erase_count);
+    CHECK(loader.erase_count <= saves / per_page + 1);
+    CHECK(erases_a <= erases_b + 1 && erases_b <= erases_a + 1);
+
+    printf("    %u saves: %u erases of A, %u of B\n", saves, erases_a, erases_b);
+}
+
+// Once the page is full, erase_spare() does the erase the next save would
+// need, so that save only programs.
+static void test_erase_spare() {
+    fresh_flash();
+    Configloader loader(PAGE_A, PAGE_B);
+    const uint32_t per_page = flash_emu::PAGE_SIZE / (8 + CONFIG_SIZE + 8);
+
+    // Nothing stored yet, nothing to do
+    CHECK(!loader.erase_spare());
+
+    // Room left in the page, or (while filling the first) the other page
+    // never used
+    uint32_t n = 0;
+    while (n < 2 * per_page) {
+        save(loader, make_config(n++));
+
+        if (n < 2 * per_page) {
+            CHECK(!loader.erase_spare());
+        }
+    }
+
+    for (uint32_t round = 0; round < 4; round++) {
+        CHECK(loader.erase_spare());
+        uint8_t result = loader.get_result();
+        while (loader.busy()) {
+            loop_once(loader);
+        }
+        CHECK_EQ(loader.get_result(), result);
+        CHECK(!loader.erase_spare());
+        CHECK(read_back(make_config(n - 1)));
+
+        uint32_t erases = loader.erase_count;
+        uint64_t took = save(loader, make_config(n++));
+        CHECK_EQ(loader.erase_count, erases);
+        CHECK(took < flash_emu::ERASE_US);
+
+        while (n % per_page) {
+            save(loader, make_config(n++));
+        }
+    }
+
+    // A save right after the erase started waits for it
+    test_config_t config = make_config(n);
+    CHECK(loader.erase_spare());
+    CHECK(!loader.write(sizeof(config), &config));
+}
+
+// A save that needs the other page erased leaves the flash alone until
+// erase_spare(), however long it is polled; the old config stays readable.
+static void test_save_waits_for_erase() {
+    fresh_flash();
+    Configloader loader(PAGE_A, PAGE_B);
+    const uint32_t per_page = flash_emu::PAGE_SIZE / (8 + CONFIG_SIZE + 8);
+
+    // Fill both pages, so the next save needs an erase
+    uint32_t n = 0;
+    while (n < 2 * per_page) {
+        save(loader, make_config(n++));
+    }
+
+    uint32_t programmed = flash_emu::halfwords_programmed;
+    uint32_t erases = flash_emu::total_erases();
+
+    test_config_t config = make_config(n);
+    CHECK(loader.write(sizeof(config), &config));
+    for (uint32_t i = 0; i < 10000; i++) {
+        loop_once(loader);
+    }
+
+    CHECK(loader.busy());
+    CHECK(loader.waiting());
+    CHECK_EQ(loader.get_state(), 4);
+    CHECK_EQ(flash_emu::halfwords_programmed, programmed);
+    CHECK_EQ(flash_emu::total_erases(), erases);
+    CHECK(read_back(make_config(n - 1)));
+
+    // Nothing else gets queued meanwhile
+    CHECK(!loader.write(sizeof(config), &config));
+
+    CHECK(loader.erase_spare());
+    CHECK(!loader.waiting());
+    while (loader.busy()) {
+        loop_once(loader);
+    }
+
+    CHECK_EQ(loader.get_result(), 1);
+    CHECK_EQ(flash_emu::total_erases(), erases + 1);
+    CHECK(read_back(config));
+}
+
+// Power cut after every poll of a save, including within an erase or a
+// halfword program: the config read back after reboot is either the old or
+// the new one, and the next save works.
+static void test_power_loss() {
+    const uint32_t max_polls = 1000;
+    uint32_t torn_old = 0;
+    uint32_t torn_new = 0;
+
+    // Enough saves beforehand that some cut saves include the page switch
+    static uint8_t saved[2 * flash_emu::PAGE_SIZE];
+
+    for (uint32_t before = 1; before <= 30; before++) {
+        fresh_flash();
+        Configloader setup(PAGE_A, PAGE_B);
+        for (uint32_t n = 0; n < before; n++) {
+            save(setup, make_config(n));
+        }
+        memcpy(saved, flash_emu::at(PAGE_A), sizeof(saved));
+
+        for (uint32_t cut = 0; cut < max_polls; cut++) {
+            memcpy(flash_emu::at(PAGE_A), saved, sizeof(saved));
+            srand(cut);
+
+            Configloader loader(PAGE_A, PAGE_B);
+            test_config_t old_config = make_config(before - 1);
+            test_config_t new_config = make_config(before);
+
+            // Coarser steps through an erase, so it is still cut in places
+            CHECK(loader.write(sizeof(new_config), &new_config));
+            for (uint32_t n = 0; n < cut && loader.busy(); n++) {
+                if (loader.waiting()) {
+                    loader.erase_spare();
+                }
+                loop_once(loader, flash_emu::erasing ? 1000 : LOOP_US);
+            }
+
+            if (!loader.busy()) {
+                // Cut came after the save finished
+                CHECK(read_back(new_config));
+                break;
+            }
+
+            flash_emu::power_loss();
+
+            bool is_old = read_back(old_config);
+            bool is_new = read_back(new_config);
+            CHECK(is_old || is_new);
+            torn_old += is_old;
+            torn_new += is_new;
+
+            Configloader rebooted(PAGE_A, PAGE_B);
+            test_config_t next_config = make_config(1000 + cut);
+            save(rebooted, next_config);
+            CHECK(read_back(next_config));
+        }
+    }
+
+    printf("    power loss: %u cuts kept the old config, %u the new\n", torn_old, torn_new);
+}
+
+// Software CRC (the host build's; identical to the CRC unit's result on
+// target) against the standard check value, fed whole or in pieces
+static void test_crc32() {
+    const char* check = "123456789";
+    CHECK_EQ(crc32(check, 9), 0xcbf43926);
+
+    for (uint32_t split = 0; split <= 9; split++) {
+        crc32_begin();
+        crc32_feed(check, split);
+        crc32_feed(check + split, 9 - split);
+        CHECK_EQ(crc32_end(), 0xcbf43926);
+    }
+}
+
+// Every halfword of a save torn in several ways: not programmed at all,
+// half its bits, or all but one. The new config only counts once its CRC
+// is complete; until then the old one is read back.
+static void test_torn_halfword() {
+    const uint32_t per_page = flash_emu::PAGE_SIZE / (8 + CONFIG_SIZE + 8);
+    const uint32_t halfwords = (8 + CONFIG_SIZE + 8) / 2;
+    const uint16_t masks[] = {0xffff, 0x00ff, 0xff00, 0x5555, 0xaaaa, 0x0001, 0x8000};
+
+    static uint8_t saved[2 * flash_emu::PAGE_SIZE];
+
+    // Appending, the first record after a page switch, and the one after it
+    const uint32_t befores[] = {1, 2, per_page, per_page + 1, 2 * per_page};
+
+    for (uint32_t before : befores) {
+        fresh_flash();
+        Configloader setup(PAGE_A, PAGE_B);
+        for (uint32_t n = 0; n < before; n++) {
+            save(setup, make_config(n));
+        }
+        memcpy(saved, flash_emu::at(PAGE_A), sizeof(saved));
+
+        test_config_t old_config = make_config(before - 1);
+        test_config_t new_config = make_config(before);
+
+        for (uint32_t torn = 0; torn < halfwords; torn++) {
+            for (uint16_t mask : masks) {
+                memcpy(flash_emu::at(PAGE_A), saved, sizeof(saved));
+                flash_emu::power_loss();
+
+                Configloader loader(PAGE_A, PAGE_B);
+                uint32_t programmed = flash_emu::halfwords_programmed;
+
+                CHECK(loader.write(sizeof(new_config), &new_config));
+                while (flash_emu::halfwords_programmed - programmed <= torn) {
+                    CHECK(loader.busy());
+                    if (loader.waiting()) {
+                        loader.erase_spare();
+                    }
+                    loop_once(loader);
+                }
+
+                uint16_t* halfword = (uint16_t*)flash_emu::at(flash_emu::last_programmed);
+                uint16_t programmed_value = *halfword;
+                *halfword |= mask;
+                flash_emu::power_loss();
+
+                bool is_new = read_back(new_config);
+                CHECK(is_new || read_back(old_config));
+
+                // Only a complete CRC makes the new record valid
+                bool complete = torn == halfwords - 1 && *halfword == programmed_value;
+                CHECK_EQ(is_new, complete);
+            }
+        }
+    }
+}
+
+// Both pages are scanned in one pass; the valid record with the highest
+// sequence number wins, wherever it is.
+static void test_newest_valid_wins() {
+    fresh_flash();
+    Configloader loader(PAGE_A, PAGE_B);
+    const uint32_t per_page = flash_emu::PAGE_SIZE / (8 + CONFIG_SIZE + 8);
+
+    // Page B full, two records in page A
+    for (uint32_t n = 0; n < per_page + 2; n++) {
+        save(loader, make_config(n));
+    }
+    CHECK(read_back(make_config(per_page + 1)));
+
+    // Damage the newest (the last byte of its data); the one before wins
+    uint32_t record = 8 + CONFIG_SIZE + 8;
+    flash_emu::at(PAGE_A + 2 * record - 9)[0] = 0;
+    CHECK(read_back(make_config(per_page)));
+
+    // And with that gone too, the newest in page B
+    flash_emu::at(PAGE_A + record - 9)[0] = 0;
+    CHECK(read_back(make_config(per_page - 1)));
+
+    // The next save continues the sequence from there, after the damage
+    save(loader, make_config(100));
+    CHECK(read_back(make_config(100)));
+}
+
+// Page B in the layout of older firmware: one record, no trailer
+static void test_legacy_page() {
+    fresh_flash();
+
+    test_config_t legacy = make_config(42);
+    uint32_t* page = (uint32_t*)flash_emu::at(PAGE_B);
+    page[0] = 0xc0ff600d;
+    page[1] = sizeof(legacy);
+    memcpy(&page[2], &legacy, sizeof(legacy));
+
+    CHECK(read_back(legacy));
+
+    // A save goes to page A and wins, with page B left alone
+    Configloader loader(PAGE_A, PAGE_B);
+    test_config_t config = make_config(43);
+    save(loader, config);
+
+    CHECK(read_back(config));
+    CHECK_EQ(page[1], sizeof(legacy));
+    CHECK(memcmp(&page[2], &legacy, sizeof(legacy)) == 0);
+}
+
+int main() {
+    crc32_init();
+
+    RUN(test_save_latency);
+    RUN(test_unchanged_save_is_free);
+    RUN(test_wear);
+    RUN(test_erase_spare);
+    RUN(test_save_waits_for_erase);
+    RUN(test_power_loss);
+    RUN(test_crc32);
+    RUN(test_torn_halfword);
+    RUN(test_newest_valid_wins);
+    RUN(test_legacy_page);
+    return 0;
+}
@@ -0,0 +1,163 @@
+#include "test.h"
+#include "ep_stage.h"
+
+// ep_stage.h with the send and flush rules of main.cpp (usb_send_locked(),
+// usb_flush_ep()) against a modelled endpoint: a write fills it, and the host
+// empties it at each poll.
+
+struct endpoint_t {
+    bool busy = false;
+
+    // report ID of each report the host picked up
+    uint8_t sent[4096];
+    uint32_t sent_count = 0;
+    uint8_t in_flight;
+};
+
+static ep_stage gamepad_stage(1);
+static ep_stage keyboard_stage(2);
+static endpoint_t endpoints[3];
+
+static void write(uint8_t ep, const uint32_t* report) {
+    endpoints[ep].busy = true;
+    endpoints[ep].in_flight = *(const uint8_t*)report;
+}
+
+static void flush_ep(uint8_t ep) {
+    ep_stage* stage = ep_stage_next(ep, gamepad_stage, keyboard_stage);
+    if (!stage || endpoints[ep].busy) {
+        return;
+    }
+
+    uint32_t* report;
+    uint32_t len;
+    if (stage->take(report, len)) {
+        write(ep, report);
+    }
+}
+
+static void send(ep_stage& stage, uint8_t report_id) {
+    uint32_t report[4] = {report_id};
+
+    if (!endpoints[stage.ep].busy &&
+        !ep_stage_next(stage.ep, gamepad_stage, keyboard_stage)) {
+        write(stage.ep, report);
+    } else {
+        stage.put(report, sizeof(report));
+        flush_ep(stage.ep);
+    }
+}
+
+// The host polls the endpoint; the interrupt refills it
+static void host_poll(uint8_t ep) {
+    endpoint_t& endpoint = endpoints[ep];
+
+    if (endpoint.busy) {
+        endpoint.busy = false;
+        endpoint.sent[endpoint.sent_count++] = endpoint.in_flight;
+    }
+
+    flush_ep(1);
+    flush_ep(2);
+}
+
+static void reset(bool combined) {
+    gamepad_stage.clear();
+    keyboard_stage.clear();
+    keyboard_stage.ep = combined ? 1 : 2;
+
+    for (endpoint_t& endpoint : endpoints) {
+        endpoint = endpoint_t();
+    }
+}
+
+// Single-interface mode with the turntable moving: a new gamepad report every
+// loop iteration, several iterations per poll. Every keyboard report still
+// goes out, at most one poll behind.
+static void test_keyboard_under_gamepad_traffic() {
+    const uint32_t loops_per_poll = 8;
+    const uint32_t loops_per_key = 40;
+    reset(true);
+
+    uint32_t keys_sent = 0;
+    for (uint32_t loop = 0; loop < 1000 * loops_per_poll; loop++) {
+        send(gamepad_stage, 1);
+
+        if (loop % loops_per_key == 0) {
+            send(keyboard_stage, 4);
+            keys_sent += 1;
+        }
+
+        if (loop % loops_per_poll == loops_per_poll - 1) {
+            host_poll(1);
+        }
+    }
+
+    endpoint_t& ep = endpoints[1];
+    uint32_t keys = 0;
+    uint32_t gamepad_run = 0;
+    uint32_t longest_gamepad_run = 0;
+
+    for (uint32_t n = 0; n < ep.sent_count; n++) {
+        if (ep.sent[n] == 4) {
+            keys += 1;
+            gamepad_run = 0;
+        } else {
+            gamepad_run += 1;
+            if (gamepad_run > longest_gamepad_run) {
+                longest_gamepad_run = gamepad_run;
+            }
+        }
+    }
+
+    CHECK_EQ(ep.sent_count, 1000);
+    CHECK_EQ(keys, keys_sent);
+    CHECK(longest_gamepad_run <= loops_per_key / loops_per_poll);
+}
+
+// Both refilled every iteration: they take turns
+static void test_alternate_when_both_busy() {
+    reset(true);
+
+    for (uint32_t loop = 0; loop < 1000; loop++) {
+        send(gamepad_stage, 1);
+        send(keyboard_stage, 4);
+        host_poll(1);
+    }
+
+    endpoint_t& ep = endpoints[1];
+    CHECK_EQ(ep.sent_count, 1000);
+    for (uint32_t n = 1; n < ep.sent_count; n++) {
+        CHECK(ep.sent[n] != ep.sent[n - 1]);
+    }
+}
+
+// Two interfaces: each stage keeps to its own endpoint
+static void test_separate_endpoints() {
+    reset(false);
+
+    for (uint32_t loop = 0; loop < 100; loop++) {
+        send(gamepad_stage, 1);
+        send(keyboard_stage, 4);
+
+        CHECK(ep_stage_next(1, gamepad_stage, keyboard_stage) != &keyboard_stage);
+        CHECK(ep_stage_next(2, gamepad_stage, keyboard_stage) != &gamepad_stage);
+
+        host_poll(1);
+        host_poll(2);
+    }
+
+    CHECK_EQ(endpoints[1].sent_count, 100);
+    CHECK_EQ(endpoints[2].sent_count, 100);
+    for (uint32_t n = 0; n < 100; n++) {
+        CHECK_EQ(endpoints[1].sent[n], 1);
+        CHECK_EQ(endpoints[2].sent[n], 4);
+    }
+}
+
+int main() {
+    RUN(test_keyboard_under_gamepad_traffic);
+    RUN(test_alternate_when_both_busy);
+    RUN(test_separate_endpoints);
+    return 0;
+}
@@ -0,0 +1,121 @@
+#!/usr/bin/env python
+
+# Incremental flashing (flashdiff.py) against its emulated flash: the slot
+# ends up holding the new image, and boots, whatever changed.
+
+from __future__ import print_function
+
+import random, sys
+
+sys.path.insert(0, '.')
+import flashdiff
+
+PAGE_SIZE = flashdiff.PAGE_SIZE
+
+def image(pages, seed):
+	rng = random.Random(seed)
+	return bytes(bytearray(rng.getrandbits(8) for n in range(pages * PAGE_SIZE - 100)))
+
+def flash(old, new, running = b''):
+	dev = flashdiff.EmulatedFlash(old, running)
+	runs = flashdiff.flash_incremental(dev, new)
+
+	assert bytes(dev.flash[:len(new)]) == new
+	assert dev.bootable()
+	return dev, runs
+
+# Nothing to write still leaves a complete, bootable slot
+def test_no_change():
+	old = image(20, 1)
+	dev, runs = flash(old, old)
+
+	assert runs == []
+	assert dev.erases == 0
+	assert dev.length == len(old)
+
+def test_one_page():
+	old = image(20, 1)
+	new = bytearray(old)
+	new[5 * PAGE_SIZE + 17] ^= 0xff
+	dev, runs = flash(old, bytes(new))
+
+	assert runs == [(5, 1, False)]
+	assert dev.erases == 1
+
+def test_runs():
+	old = image(40, 1)
+	new = bytearray(old)
+	for page in (0, 1, 2, 10, 39):
+		new[page * PAGE_SIZE] ^= 1
+	dev, runs = flash(old, bytes(new))
+
+	assert runs == [(0, 3, False), (10, 1, False), (39, 1, False)]
+	assert dev.erases == 5
+
+def test_grow_and_shrink():
+	small = image(10, 1)
+	large = image(30, 1)[:len(small)] + image(30, 2)[len(small):]
+
+	flash(small, large)
+	flash(large, small)
+
+# An older, longer image with the slot marker leaves it in pages past the end
+# of a new image without one; the new image must not count as confirming
+def test_stale_marker():
+	old = bytearray(image(30, 1))
+	old[25 * PAGE_SIZE:25 * PAGE_SIZE + 8] = flashdiff.SLOT_MARKER
+	new = image(10, 2)
+
+	dev, runs = flash(bytes(old), new)
+	assert dev.length == len(new)
+	assert not dev.marker
+
+	dev, runs = flash(new, bytes(old))
+	assert dev.marker
+
+def test_from_empty():
+	new = image(25, 3)
+	dev, runs = flash(b'', new)
+
+	assert runs == [(0, 25, False)]
+
+# The slot being flashed holds the firmware from two flashes ago (here none at
+# all); pages the running one already has are copied from it, and only the
+# rest is sent. Not the first page: its vector table is linked for its slot.
+def test_copy_from_running():
+	running = image(20, 1)
+	new = bytearray(running)
+	for page in (0, 7, 8):
+		new[page * PAGE_SIZE + 3] ^= 0xff
+	dev, runs = flash(b'', bytes(new), running)
+
+	assert runs == [(0, 1, False), (1, 6, True), (7, 2, False), (9, 11, True)]
+	assert dev.copied == 17
+	assert dev.erases == 20
+
+	# What both slots already have is skipped, not copied
+	dev, runs = flash(running, bytes(new), running)
+	assert runs == [(0, 1, False), (7, 2, False)]
+	assert dev.copied == 0
+
+# A plain (non-incremental) prepare ends the image where writing stopped
+def test_plain_prepare():
+	dev = flashdiff.EmulatedFlash()
+	new = image(3, 4)
+
+	dev.prepare()
+	for n in range(0, len(new), flashdiff.BLOCK_SIZE):
+		dev.write_block(new[n:n + flashdiff.BLOCK_SIZE])
+	dev.finish()
+
+	assert dev.length == len(new)
+	assert dev.bootable()
+
+	dev.prepare()
+	dev.finish()
+	assert not dev.bootable()
+
+for test in (test_no_change, test_one_page, test_runs, test_grow_and_shrink,
+		test_stale_marker, test_from_empty, test_copy_from_running, test_plain_prepare):
+	test()
+	print('  %s' % test.__name__)
@@ -0,0 +1,247 @@
+#include "test.h"
+#include <string.h>
+#include <time.h>
+#include "runtime_plan.h"
+
+// The analog turntable scale in the plan against the count * mul / div it
+// replaced, for every sensitivity over its whole counter range (TIM2.ARR as
+// set by apply_config()).
+static void test_qe1_scale_is_exact() {
+    config_t config;
+    memset(&config, 0, sizeof(config));
+    config_flags flags;
+    flags.AsUINT32 = 0;
+
+    for (int32_t sens = -128; sens <= 127; sens++) {
+        config.qe1_sens = sens;
+
+        runtime_plan_t plan;
+        build_runtime_plan(plan, config, flags, false, 0);
+
+        uint32_t mul = (sens > 0) ? sens : 1;
+        uint32_t div = (sens < 0) ? -sens : 1;
+        uint32_t range = (sens < 0) ? 256 * -sens : 256;
+
+        for (uint32_t count = 0; count < range; count++) {
+            uint32_t scaled = ((uint64_t)count * plan.qe1_scale) >> QE1_SCALE_SHIFT;
+            CHECK_EQ(scaled, count * mul / div);
+        }
+    }
+}
+
+static const uint16_t keys[] = {
+    INFINITAS_BUTTON_1, INFINITAS_BUTTON_2, INFINITAS_BUTTON_3,
+    INFINITAS_BUTTON_4, INFINITAS_BUTTON_5, INFINITAS_BUTTON_6,
+    INFINITAS_BUTTON_7, INFINITAS_BUTTON_E1, INFINITAS_BUTTON_E2,
+    INFINITAS_BUTTON_E3, INFINITAS_BUTTON_E4,
+};
+static const uint8_t key_count = sizeof(keys) / sizeof(keys[0]);
+
+// What the main loop sends for one iteration's inputs
+struct frame_t {
+    uint16_t buttons;
+    uint8_t axis_x;
+    uint16_t keyboard_inputs;
+    uint8_t scancodes[13];
+};
+
+// The report building of the main loop before the plan, testing the config
+// and mode switch flags as it went
+__attribute__((noinline))
+static void legacy_frame(
+    const config_t& config, config_flags flags, bool reverse_tt,
+    uint16_t remapped, int8_t tt1_report, uint32_t qe1_count, frame_t& frame) {
+
+    memset(&frame, 0, sizeof(frame));
+
+    if (flags.JoyInputForceDisable) {
+        frame.buttons = 0;
+    } else {
+        uint16_t buttons = remapped;
+        if (flags.DigitalTTEnable) {
+            switch (tt1_report) {
+            case -1:
+                buttons |= JOY_BUTTON_13;
+                break;
+            case 1:
+                buttons |= JOY_BUTTON_14;
+                break;
+            default:
+                break;
+            }
+        }
+        frame.buttons = buttons;
+    }
+
+    if (flags.JoyInputForceDisable ||
+        (flags.DigitalTTEnable && !flags.AnalogTTForceEnable)) {
+        frame.axis_x = uint8_t(127);
+    } else {
+        if (config.qe1_sens < 0) {
+            qe1_count /= -config.qe1_sens;
+        } else if (config.qe1_sens > 0) {
+            qe1_count *= config.qe1_sens;
+        }
+        if (reverse_tt) {
+            frame.axis_x = uint8_t(255 - qe1_count);
+        } else {
+            frame.axis_x = uint8_t(qe1_count);
+        }
+    }
+
+    if (flags.KeyboardEnable) {
+        uint16_t inputs = remapped & (INFINITAS_BUTTON_ALL | INFINITAS_EFFECTORS_ALL);
+        switch (tt1_report) {
+        case -1:
+            inputs |= JOY_BUTTON_13;
+            break;
+        case 1:
+            inputs |= JOY_BUTTON_14;
+            break;
+        default:
+            break;
+        }
+        frame.keyboard_inputs = inputs;
+
+        uint8_t nextscan = 0;
+        for (uint8_t i = 0; i < key_count; i++) {
+            if (remapped & keys[i]) {
+                frame.scancodes[nextscan++] = config.keycodes[i];
+            }
+        }
+
+        switch (tt1_report) {
+        case -1:
+            frame.scancodes[nextscan++] = config.keycodes[11];
+            break;
+        case 1:
+            frame.scancodes[nextscan++] = config.keycodes[12];
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+// The same from the plan, as main.cpp does now
+__attribute__((noinline))
+static void plan_frame(
+    const runtime_plan_t& plan, const config_t& config,
+    uint16_t remapped, int8_t tt1_report, uint32_t qe1_count, frame_t& frame) {
+
+    memset(&frame, 0, sizeof(frame));
+
+    frame.buttons = plan_gamepad_buttons(plan, remapped, tt1_report);
+    frame.axis_x = plan_axis_x(plan, qe1_count);
+    frame.keyboard_inputs = plan_keyboard_inputs(plan, remapped, tt1_report);
+    plan_scancodes(plan, keys, config.keycodes, remapped, tt1_report, frame.scancodes);
+}
+
+static uint32_t next_random(uint32_t& state) {
+    state = state * 1103515245 + 12345;
+    return state >> 8;
+}
+
+static config_t make_config(int8_t sens) {
+    config_t config;
+    memset(&config, 0, sizeof(config));
+    config.qe1_sens = sens;
+    for (uint32_t i = 0; i < sizeof(config.keycodes); i++) {
+        config.keycodes[i] = 0x04 + i;
+    }
+    return config;
+}
+
+// Every combination of the flags the reports depend on, both turntable
+// directions and a range of sensitivities: the plan builds the same reports
+// as the flag tests it replaced
+static void test_same_reports() {
+    const int8_t sensitivities[] = {-128, -5, -1, 0, 1, 3, 127};
+    uint32_t random = 1;
+
+    for (int8_t sens : sensitivities) {
+        config_t config = make_config(sens);
+        uint32_t range = (sens < 0) ? 256 * -sens : 256;
+
+        for (uint32_t bits = 0; bits < 32; bits++) {
+            config_flags flags;
+            flags.AsUINT32 = 0;
+            flags.DigitalTTEnable = bits & 1;
+            flags.AnalogTTForceEnable = (bits >> 1) & 1;
+            flags.KeyboardEnable = (bits >> 2) & 1;
+            flags.JoyInputForceDisable = (bits >> 3) & 1;
+            bool reverse_tt = (bits >> 4) & 1;
+
+            runtime_plan_t plan;
+            build_runtime_plan(plan, config, flags, reverse_tt, key_count);
+
+            for (uint32_t n = 0; n < 1000; n++) {
+                uint16_t remapped = next_random(random) & 0x0fff;
+                int8_t tt1_report = (int8_t)(next_random(random) % 3) - 1;
+                uint32_t qe1_count = next_random(random) % range;
+
+                frame_t expected;
+                frame_t actual;
+                legacy_frame(config, flags, reverse_tt, remapped, tt1_report, qe1_count, expected);
+                plan_frame(plan, config, remapped, tt1_report, qe1_count, actual);
+
+                CHECK_EQ(actual.buttons, expected.buttons);
+                CHECK_EQ(actual.axis_x, expected.axis_x);
+                CHECK_EQ(actual.keyboard_inputs, expected.keyboard_inputs);
+                CHECK(memcmp(actual.scancodes, expected.scancodes, sizeof(actual.scancodes)) == 0);
+            }
+        }
+    }
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Report building per millisecond on the host, before and after the plan, in
+// the default Infinitas setup (analog turntable, keyboard on, sensitivity
+// divided). Only printed: host timings say little about the target, where
+// telemetry's loop_count gives the whole loop's rate.
+static void test_frame_rate() {
+    const uint32_t frames = 2000000;
+
+    config_t config = make_config(-4);
+    config_flags flags;
+    flags.AsUINT32 = 0;
+    flags.KeyboardEnable = 1;
+
+    runtime_plan_t plan;
+    build_runtime_plan(plan, config, flags, false, key_count);
+
+    uint32_t sink = 0;
+    frame_t frame;
+
+    uint64_t start = now_ns();
+    for (uint32_t n = 0; n < frames; n++) {
+        legacy_frame(config, flags, false, n & 0x0fff, (n % 3) - 1, n & 0x3ff, frame);
+        sink += frame.axis_x + frame.scancodes[0];
+    }
+    uint64_t legacy_ns = now_ns() - start;
+
+    start = now_ns();
+    for (uint32_t n = 0; n < frames; n++) {
+        plan_frame(plan, config, n & 0x0fff, (n % 3) - 1, n & 0x3ff, frame);
+        sink += frame.axis_x + frame.scancodes[0];
+    }
+    uint64_t plan_ns = now_ns() - start;
+
+    CHECK(sink != 0);
+
+    printf("    host: %llu frames/ms with flag tests, %llu with the plan\n",
+        (unsigned long long)(frames * 1000000ull / legacy_ns),
+        (unsigned long long)(frames * 1000000ull / plan_ns));
+}
+
+int main() {
+    RUN(test_qe1_scale_is_exact);
+    RUN(test_same_reports);
+    RUN(test_frame_rate);
+    return 0;
+}
@@ -0,0 +1,168 @@
+#include "test.h"
+#include "tt_accel.h"
+
+// Synthetic encoder sequences through tt_accel: one poll per millisecond,
+// QE1 counter range 256 as configured in main.cpp.
+
+static const uint32_t RANGE = 256;
+
+// Signed distance between two counter values, as tt_accel computes it
+static int32_t distance(uint32_t from, uint32_t to) {
+    int32_t d = (int32_t)((to + RANGE - from) % RANGE);
+    if ((uint32_t)d > RANGE / 2) {
+        d -= RANGE;
+    }
+    return d;
+}
+
+// Spins at a constant speed (counts per ms) for some time, and returns the
+// accelerated counts over the last ms.
+static int32_t steady_output(tt_accel& accel, int32_t speed, uint32_t ms) {
+    uint32_t raw = 0;
+    uint32_t out = 0;
+    uint32_t previous_out = 0;
+
+    accel.reset();
+    Time::host_now = 1000;
+
+    for (uint32_t n = 0; n < ms; n++) {
+        Time::host_now++;
+        raw = (raw + RANGE + speed) % RANGE;
+        previous_out = out;
+        out = accel.poll(raw);
+    }
+
+    return distance(previous_out, out);
+}
+
+static void test_unity_curve_is_identity() {
+    const uint8_t points[TT_ACCEL_POINT_COUNT] = {32, 32, 32};
+    tt_accel accel;
+    accel.init(points, RANGE);
+
+    uint32_t raw = 17;
+    srand(1);
+
+    for (uint32_t n = 0; n < 20000; n++) {
+        Time::host_now += rand() % 3;
+        raw = (raw + RANGE + (rand() % 41) - 20) % RANGE;
+        CHECK_EQ(accel.poll(raw), raw);
+    }
+}
+
+static void test_unset_points_are_identity() {
+    const uint8_t points[TT_ACCEL_POINT_COUNT] = {0, 0, 0};
+    tt_accel accel;
+    accel.init(points, RANGE);
+
+    for (uint32_t s = 0; s < TT_ACCEL_CURVE_LEN + 10; s++) {
+        CHECK_EQ(accel.get_gain(s), 1 << TT_ACCEL_FRAC_BITS);
+    }
+}
+
+static void test_curve_is_monotonic() {
+    // Includes control points that decrease, which init() evens out
+    const uint8_t configs[][TT_ACCEL_POINT_COUNT] = {
+        {32, 64, 96},
+        {16, 32, 255},
+        {96, 64, 32},
+        {32, 16, 64},
+        {1, 255, 2},
+    };
+
+    for (const uint8_t* points : configs) {
+        tt_accel accel;
+        accel.init(points, RANGE);
+
+        for (uint32_t s = 1; s < TT_ACCEL_CURVE_LEN + 10; s++) {
+            CHECK(accel.get_gain(s) >= accel.get_gain(s - 1));
+        }
+    }
+}
+
+static void test_faster_never_moves_less() {
+    const uint8_t points[TT_ACCEL_POINT_COUNT] = {24, 48, 128};
+    tt_accel accel;
+    accel.init(points, RANGE);
+
+    int32_t previous = 0;
+    for (int32_t speed = 1; speed < 32; speed++) {
+        int32_t moved = steady_output(accel, speed, 64);
+        CHECK(moved >= previous);
+        CHECK_EQ(steady_output(accel, -speed, 64), -moved);
+        previous = moved;
+    }
+}
+
+// With a constant gain, the output is the input scaled exactly, however the
+// counts arrive: the fractional remainder is carried over, never dropped.
+static void test_constant_gain_does_not_drift() {
+    const uint8_t points[TT_ACCEL_POINT_COUNT] = {48, 48, 48}; // 1.5x
+    tt_accel accel;
+    accel.init(points, RANGE);
+
+    uint32_t raw = 0;
+    int64_t travelled = 0;
+    uint32_t out = accel.poll(raw);
+    int64_t output = 0;
+    srand(2);
+
+    for (uint32_t n = 0; n < 100000; n++) {
+        Time::host_now += 1;
+
+        // Slow jitter back and forth, one count at a time
+        int32_t step = (rand() % 3) - 1;
+        raw = (raw + RANGE + step) % RANGE;
+        travelled += step;
+
+        uint32_t next = accel.poll(raw);
+        output += distance(out, next);
+        out = next;
+
+        // Within one count (the residual) of 1.5x at every step
+        int64_t expected = travelled * 3;
+        CHECK(output * 2 <= expected + 2 && output * 2 >= expected - 2);
+    }
+}
+
+// Back and forth at the same speed ends up where it started.
+static void test_round_trip_returns_home() {
+    const uint8_t points[TT_ACCEL_POINT_COUNT] = {32, 64, 160};
+    tt_accel accel;
+    accel.init(points, RANGE);
+
+    for (int32_t speed = 1; speed < 12; speed++) {
+        accel.reset();
+        Time::host_now = 5000;
+
+        uint32_t raw = 100;
+        uint32_t start = accel.poll(raw);
+        uint32_t out = start;
+
+        for (int32_t dir = 1; dir >= -1; dir -= 2) {
+            for (uint32_t n = 0; n < 40; n++) {
+                Time::host_now++;
+                raw = (raw + RANGE + dir * speed) % RANGE;
+                out = accel.poll(raw);
+            }
+
+            // Let the speed window empty out between directions
+            for (uint32_t n = 0; n < TT_ACCEL_WINDOW_MS; n++) {
+                Time::host_now++;
+                out = accel.poll(raw);
+            }
+        }
+
+        CHECK_EQ(out, start);
+    }
+}
+
+int main() {
+    RUN(test_unity_curve_is_identity);
+    RUN(test_unset_points_are_identity);
+    RUN(test_curve_is_monotonic);
+    RUN(test_faster_never_moves_less);
+    RUN(test_constant_gain_does_not_drift);
+    RUN(test_round_trip_returns_home);
+    return 0;
+}